@@ -12,12 +12,9 @@ public:
 	{
 		while (true)
 		{
-			if (!m_messages_queue.MessageInEmpty())
-			{
-				net::Message<Protocal> message = m_messages_queue.ReadMessageIn();
-				std::cout << "Message sent from server: \n" << message.to_json() << std::endl;
-				m_messages_queue.PopMessageIn();
-			}
+			net::Message<Protocal> message;
+			m_messages_queue.PopMessageIn(message);
+			std::cout << "Message sent from server: \n" << message.to_json() << std::endl;
 		}
 	}
 };
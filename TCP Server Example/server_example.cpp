@@ -11,17 +11,19 @@ protected:
     virtual void OnClientConnect(ConnectionPtr& new_connection) override
     {
 		net::Message<Protocal> message;
-		message << (m_connection_count + m_id);
+		message << new_connection->GetId();
 
 		new_connection->WriteMessage(message);
 		new_connection->ReadMessage();
 
+		// Encode the broadcast once, every connection only queues a reference to it.
+		net::SharedFramePtr<Protocal> frame = net::SharedFrame<Protocal>::Encode(message);
 		std::vector<size_t> dead_connections_id;
 		for (auto& [id, conn] : m_connections)
 		{
 			if (conn->IsOpen())
 			{
-				conn->WriteMessage(message);
+				conn->WriteFrame(frame);
 			}
 			else
 			{
@@ -36,7 +38,7 @@ protected:
 			m_connections.erase(id);
 		}
 
-		m_connections[m_connection_count + m_id] = std::move(new_connection);
+		m_connections[new_connection->GetId()] = std::move(new_connection);
 		m_connection_count += 1;
 		std::cout << "Connections = " << m_connections.size() << std::endl;
     }
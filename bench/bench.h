@@ -0,0 +1,147 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bench
+{
+	// A benchmark is a function registered by name with NET_BENCHMARK, it runs its own
+	// workload and reports the numbers it measured with Report().
+	struct Benchmark
+	{
+		std::string name;
+		std::function<void()> function;
+	};
+
+	inline std::vector<Benchmark>& Registry()
+	{
+		static std::vector<Benchmark> benchmarks;
+		return benchmarks;
+	}
+
+	struct Registrar
+	{
+		Registrar(const char* name, std::function<void()> function)
+		{
+			Registry().push_back({ name, std::move(function) });
+		}
+	};
+
+	// Measures the wall clock time since construction.
+	class Stopwatch
+	{
+	public:
+		Stopwatch() : m_start(std::chrono::steady_clock::now()) {}
+		double Seconds() const
+		{
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+		}
+	private:
+		std::chrono::steady_clock::time_point m_start;
+	};
+
+	// Settings of the runner, given on its command line.
+	struct Options
+	{
+		// Run the full parameter sweep instead of the quick default one.
+		bool full = false;
+		// Every result is also written to this file as one JSON object per line, if set.
+		std::FILE* json = nullptr;
+	};
+
+	inline Options& GetOptions()
+	{
+		static Options options;
+		return options;
+	}
+
+	// Collects latency samples in nanoseconds and computes their percentiles.
+	class LatencyRecorder
+	{
+	public:
+		void Record(std::chrono::steady_clock::duration latency)
+		{
+			m_samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+		}
+		size_t Count() const
+		{
+			return m_samples.size();
+		}
+		// Returns the sample below which the fraction p of the samples lie. Reorders the samples.
+		double Percentile(double p)
+		{
+			if (m_samples.empty())
+				return 0;
+			size_t index = std::min(static_cast<size_t>(p * m_samples.size()), m_samples.size() - 1);
+			std::nth_element(m_samples.begin(), m_samples.begin() + index, m_samples.end());
+			return static_cast<double>(m_samples[index]);
+		}
+	private:
+		std::vector<int64_t> m_samples;
+	};
+
+	// The numbers measured by one case. parameters describe the case, e.g. message size or
+	// thread count. bytes and the percentiles are left zero by cases that do not measure them.
+	struct Result
+	{
+		std::string name;
+		std::vector<std::pair<std::string, size_t>> parameters;
+		size_t operations = 0;
+		double seconds = 0;
+		size_t bytes = 0;
+		double p50_ns = 0;
+		double p99_ns = 0;
+		double p999_ns = 0;
+	};
+
+	// Prints a result, and writes it to the JSON output if there is one.
+	inline void Report(const Result& result)
+	{
+		std::string label = result.name;
+		for (const auto& [key, value] : result.parameters)
+			label += " " + key + "=" + std::to_string(value);
+		std::printf("%-48s %12.0f ops/s %10.1f ns/op", label.c_str(),
+			result.operations / result.seconds, result.seconds * 1e9 / result.operations);
+		if (result.bytes > 0)
+			std::printf(" %10.1f MB/s", result.bytes / result.seconds / 1e6);
+		if (result.p50_ns > 0)
+			std::printf("  p50 %.1f us p99 %.1f us p999 %.1f us", result.p50_ns / 1e3, result.p99_ns / 1e3, result.p999_ns / 1e3);
+		std::printf("\n");
+		std::fflush(stdout);
+
+		std::FILE* json = GetOptions().json;
+		if (json == nullptr)
+			return;
+		std::fprintf(json, "{\"name\":\"%s\",\"parameters\":{", result.name.c_str());
+		for (size_t i = 0; i < result.parameters.size(); ++i)
+			std::fprintf(json, "%s\"%s\":%zu", i > 0 ? "," : "", result.parameters[i].first.c_str(), result.parameters[i].second);
+		std::fprintf(json, "},\"operations\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"bytes_per_sec\":%.1f,"
+			"\"p50_ns\":%.0f,\"p99_ns\":%.0f,\"p999_ns\":%.0f}\n",
+			result.operations, result.seconds, result.operations / result.seconds, result.bytes / result.seconds,
+			result.p50_ns, result.p99_ns, result.p999_ns);
+		std::fflush(json);
+	}
+
+	// Prints the throughput of a case, operations is the number of operations done in seconds.
+	inline void Report(const std::string& name, size_t operations, double seconds)
+	{
+		Result result;
+		result.name = name;
+		result.operations = operations;
+		result.seconds = seconds;
+		Report(result);
+	}
+}
+
+#define NET_BENCHMARK_CONCAT_IMPL(a, b) a##b
+#define NET_BENCHMARK_CONCAT(a, b) NET_BENCHMARK_CONCAT_IMPL(a, b)
+// Defines and registers a benchmark, the body follows the macro like a function body.
+#define NET_BENCHMARK(name) \
+	static void name(); \
+	static bench::Registrar NET_BENCHMARK_CONCAT(name, _registrar)(#name, name); \
+	static void name()
@@ -0,0 +1,171 @@
+#include <thread>
+#include "bench.h"
+#include "connection/connection.h"
+#include "connection/coro_connection.h"
+
+namespace
+{
+	enum class Protocal
+	{
+		DATA
+	};
+
+	constexpr size_t MessagesPerCase = 100000;
+	constexpr size_t Window = 64;
+
+	// Connects two connections of type Conn over loopback, one echoing every message it receives,
+	// and keeps Window messages of body_size bytes in flight until MessagesPerCase round trips
+	// completed. Reports the round trips per second.
+	template<template<net::Protocal, typename> class Conn>
+	void RunEcho(const std::string& name, size_t body_size)
+	{
+		using Queue = net::MessageQueue<Protocal>;
+		using Connection = Conn<Protocal, Queue>;
+
+		asio::io_context io_context(1);
+		tcp::acceptor acceptor(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+		tcp::socket client_socket(io_context);
+		client_socket.connect(acceptor.local_endpoint());
+		tcp::socket server_socket = acceptor.accept();
+		client_socket.set_option(tcp::no_delay(true));
+		server_socket.set_option(tcp::no_delay(true));
+
+		Queue server_queue;
+		Queue client_queue;
+		auto server = std::make_shared<Connection>(1, io_context, std::move(server_socket), server_queue);
+		auto client = std::make_shared<Connection>(2, io_context, std::move(client_socket), client_queue);
+		server->ReadMessage();
+		client->ReadMessage();
+
+		auto work = asio::make_work_guard(io_context);
+		std::thread io_thread([&io_context]() { io_context.run(); });
+		std::thread echo_thread([&server, &server_queue]()
+		{
+			net::Message<Protocal> message;
+			for (size_t n = 0; n < MessagesPerCase; ++n)
+			{
+				server_queue.PopMessageIn(message);
+				server->WriteMessage(std::move(message));
+			}
+		});
+
+		net::Message<Protocal>::body_type body(body_size, 7);
+		net::Message<Protocal> request = net::Message<Protocal>::ConstructMessage(Protocal::DATA, body);
+		bench::Stopwatch stopwatch;
+		size_t sent = 0;
+		for (; sent < Window; ++sent)
+			client->WriteMessage(request);
+		net::Message<Protocal> reply;
+		for (size_t received = 0; received < MessagesPerCase; ++received)
+		{
+			client_queue.PopMessageIn(reply);
+			if (sent < MessagesPerCase)
+			{
+				client->WriteMessage(request);
+				sent += 1;
+			}
+		}
+		double seconds = stopwatch.Seconds();
+
+		echo_thread.join();
+		client->Disconnect();
+		server->Disconnect();
+		work.reset();
+		io_thread.join();
+		bench::Report(name + " body=" + std::to_string(body_size), MessagesPerCase, seconds);
+	}
+
+	// Connects subscribers pairs of connections over loopback and publishes messages of body_size
+	// bytes to every server side connection, keeping up to Window messages per subscriber in
+	// flight, until MessagesPerCase messages were delivered in total. Reports the deliveries per second.
+	// With shared, each message is encoded once into a SharedFrame and only referenced by the
+	// connections, otherwise every connection queues its own copy.
+	void RunFanOut(const std::string& name, size_t subscribers, size_t body_size, bool shared)
+	{
+		using Queue = net::MessageQueue<Protocal>;
+		using Connection = net::Connection<Protocal, Queue>;
+
+		asio::io_context io_context(1);
+		tcp::acceptor acceptor(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+		Queue server_queue;
+		Queue client_queue;
+		std::vector<std::shared_ptr<Connection>> servers;
+		std::vector<std::shared_ptr<Connection>> clients;
+		for (size_t i = 0; i < subscribers; ++i)
+		{
+			tcp::socket client_socket(io_context);
+			client_socket.connect(acceptor.local_endpoint());
+			tcp::socket server_socket = acceptor.accept();
+			client_socket.set_option(tcp::no_delay(true));
+			server_socket.set_option(tcp::no_delay(true));
+			servers.push_back(std::make_shared<Connection>(i, io_context, std::move(server_socket), server_queue));
+			clients.push_back(std::make_shared<Connection>(i, io_context, std::move(client_socket), client_queue));
+			clients.back()->ReadMessage();
+		}
+
+		auto work = asio::make_work_guard(io_context);
+		std::thread io_thread([&io_context]() { io_context.run(); });
+
+		net::Message<Protocal>::body_type body(body_size, 7);
+		net::Message<Protocal> message = net::Message<Protocal>::ConstructMessage(Protocal::DATA, body);
+		size_t publishes = MessagesPerCase / subscribers;
+		size_t deliveries = publishes * subscribers;
+		bench::Stopwatch stopwatch;
+		size_t published = 0;
+		net::Message<Protocal> received;
+		for (size_t delivered = 0; delivered < deliveries; ++delivered)
+		{
+			for (; published < publishes && published * subscribers < delivered + Window * subscribers; ++published)
+			{
+				if (shared)
+				{
+					net::SharedFramePtr<Protocal> frame = net::SharedFrame<Protocal>::Encode(message);
+					for (const std::shared_ptr<Connection>& server : servers)
+						server->WriteFrame(frame);
+				}
+				else
+				{
+					for (const std::shared_ptr<Connection>& server : servers)
+						server->WriteMessage(message);
+				}
+			}
+			client_queue.PopMessageIn(received);
+		}
+		double seconds = stopwatch.Seconds();
+
+		for (size_t i = 0; i < subscribers; ++i)
+		{
+			clients[i]->Disconnect();
+			servers[i]->Disconnect();
+		}
+		work.reset();
+		io_thread.join();
+		bench::Report(name + " subscribers=" + std::to_string(subscribers) + " body=" + std::to_string(body_size), deliveries, seconds);
+	}
+}
+
+// Compares the callback Connection with the coroutine CoroConnection on a pipelined echo over
+// loopback, both driven by one io_context thread.
+NET_BENCHMARK(connection_echo)
+{
+	for (size_t body_size : { 16, 1024, 16 * 1024 })
+	{
+		RunEcho<net::Connection>("callback", body_size);
+		RunEcho<net::CoroConnection>("coroutine", body_size);
+	}
+}
+
+// Publishes every message to all subscribers, the shape of a broadcast server, driven by one
+// io_context thread, with a copy per subscriber and with one shared frame. Build with
+// NET_USE_IO_URING to compare the io_uring backend with epoll.
+NET_BENCHMARK(connection_fan_out)
+{
+	for (size_t subscribers : { 1, 16, 256 })
+	{
+		for (size_t body_size : { 16, 1024, 16 * 1024 })
+		{
+			RunFanOut("copy", subscribers, body_size, false);
+			RunFanOut("shared", subscribers, body_size, true);
+		}
+	}
+}
@@ -0,0 +1,122 @@
+#include <array>
+#include <functional>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "bench.h"
+#include "connection/dispatcher.h"
+
+namespace
+{
+	enum class Protocal
+	{
+		LOGIN,
+		LOGOUT,
+		CHAT,
+		MOVE,
+		ATTACK,
+		TRADE,
+		PING,
+		PONG
+	};
+
+	constexpr size_t ProtocalCount = 8;
+	constexpr size_t Messages = 10000000;
+
+	struct Counters
+	{
+		std::array<uint64_t, ProtocalCount> handled{};
+
+		template<Protocal P>
+		void Handle(net::Message<Protocal>& message)
+		{
+			handled[static_cast<size_t>(P)] += message.header.size;
+		}
+	};
+
+	template<Protocal P>
+	using CountHandler = net::Handler<P, &Counters::Handle<P>>;
+
+	using CountDispatcher = net::Dispatcher<Protocal, CountHandler<Protocal::LOGIN>, CountHandler<Protocal::LOGOUT>,
+		CountHandler<Protocal::CHAT>, CountHandler<Protocal::MOVE>, CountHandler<Protocal::ATTACK>,
+		CountHandler<Protocal::TRADE>, CountHandler<Protocal::PING>, CountHandler<Protocal::PONG>>;
+
+	// Handles Messages messages with random protocals through dispatch and reports messages per second.
+	template<typename Dispatch>
+	void RunDispatch(const char* name, Dispatch dispatch)
+	{
+		std::mt19937 random(42);
+		std::vector<net::Message<Protocal>> messages(1024);
+		for (net::Message<Protocal>& message : messages)
+		{
+			message.header.protocal = static_cast<Protocal>(random() % ProtocalCount);
+			message.header.size = 1;
+		}
+
+		Counters counters;
+		bench::Stopwatch stopwatch;
+		for (size_t i = 0; i < Messages; ++i)
+			dispatch(counters, messages[i % messages.size()]);
+		double seconds = stopwatch.Seconds();
+
+		uint64_t handled = 0;
+		for (uint64_t count : counters.handled)
+			handled += count;
+		if (handled != Messages)
+			std::printf("%s handled %llu of %zu messages\n", name, static_cast<unsigned long long>(handled), Messages);
+		bench::Report(name, Messages, seconds);
+	}
+}
+
+// Cost of choosing the handler of a message by its protocal: the compile-time Dispatcher, on
+// its own and behind a DispatchQueue, a hand-written switch and a map of std::function, the
+// usual runtime registration.
+NET_BENCHMARK(dispatch)
+{
+	RunDispatch("dispatcher", [](Counters& counters, net::Message<Protocal>& message)
+	{
+		CountDispatcher::Dispatch(message, counters);
+	});
+
+	RunDispatch("switch", [](Counters& counters, net::Message<Protocal>& message)
+	{
+		switch (message.header.protocal)
+		{
+		case Protocal::LOGIN: counters.Handle<Protocal::LOGIN>(message); break;
+		case Protocal::LOGOUT: counters.Handle<Protocal::LOGOUT>(message); break;
+		case Protocal::CHAT: counters.Handle<Protocal::CHAT>(message); break;
+		case Protocal::MOVE: counters.Handle<Protocal::MOVE>(message); break;
+		case Protocal::ATTACK: counters.Handle<Protocal::ATTACK>(message); break;
+		case Protocal::TRADE: counters.Handle<Protocal::TRADE>(message); break;
+		case Protocal::PING: counters.Handle<Protocal::PING>(message); break;
+		case Protocal::PONG: counters.Handle<Protocal::PONG>(message); break;
+		}
+	});
+
+	// The same dispatcher behind a DispatchQueue, the way a connection hands it received messages.
+	net::DispatchQueue<Protocal, CountDispatcher, Counters> queue;
+	RunDispatch("dispatch queue", [&queue](Counters& counters, net::Message<Protocal>& message)
+	{
+		queue.SetContext(&counters);
+		queue.WriteMessageIn(message);
+	});
+
+	using Function = std::function<void(Counters&, net::Message<Protocal>&)>;
+	std::unordered_map<Protocal, Function> functions =
+	{
+		{ Protocal::LOGIN, &Counters::Handle<Protocal::LOGIN> },
+		{ Protocal::LOGOUT, &Counters::Handle<Protocal::LOGOUT> },
+		{ Protocal::CHAT, &Counters::Handle<Protocal::CHAT> },
+		{ Protocal::MOVE, &Counters::Handle<Protocal::MOVE> },
+		{ Protocal::ATTACK, &Counters::Handle<Protocal::ATTACK> },
+		{ Protocal::TRADE, &Counters::Handle<Protocal::TRADE> },
+		{ Protocal::PING, &Counters::Handle<Protocal::PING> },
+		{ Protocal::PONG, &Counters::Handle<Protocal::PONG> },
+	};
+	RunDispatch("std::function map", [&functions](Counters& counters, net::Message<Protocal>& message)
+	{
+		auto it = functions.find(message.header.protocal);
+		if (it != functions.end())
+			it->second(counters, message);
+	});
+}
@@ -0,0 +1,486 @@
+#include <atomic>
+#include <thread>
+#include "bench.h"
+#include "server/tcp_server.h"
+
+namespace
+{
+	enum class Protocal
+	{
+		DATA
+	};
+
+	using Clock = std::chrono::steady_clock;
+
+	// Sends every message on to the connection named by its header.dest, or back to the one
+	// named by its header.from if it has no destination. The clients set both to the ids the
+	// server gave their connections.
+	class EchoServer : public net::TcpServer<Protocal>
+	{
+	public:
+		using TcpServer::TcpServer;
+
+		size_t Accepted() const
+		{
+			return m_accepted.load(std::memory_order_acquire);
+		}
+
+		// Id of the connection accepted in the given order.
+		size_t ConnectionId(size_t index) const
+		{
+			return m_id + index;
+		}
+	protected:
+		virtual void OnClientConnect(ConnectionPtr& new_connection) override
+		{
+			new_connection->ReadMessage();
+			m_connections[new_connection->GetId()] = new_connection;
+			m_connection_count += 1;
+			m_accepted.store(m_connection_count, std::memory_order_release);
+		}
+
+		virtual void HandleMessage() override
+		{
+			net::Message<Protocal> message;
+			while (m_message_queue.TryPopMessageIn(message))
+				Echo(message);
+		}
+
+		void Echo(net::Message<Protocal>& message)
+		{
+			ConnectionPtr connection;
+			{
+				std::scoped_lock lock(m_connections_mutex);
+				size_t target = message.header.dest != 0 ? message.header.dest : message.header.from;
+				auto it = m_connections.find(target);
+				if (it != m_connections.end())
+					connection = it->second;
+			}
+			if (connection)
+				connection->WriteMessage(std::move(message));
+		}
+	private:
+		std::atomic<size_t> m_accepted{ 0 };
+	};
+
+	// An EchoServer that spins for work before echoing each message, a CPU-heavy handler, on the
+	// thread running Start() or on the workers if the options ask for them.
+	class WorkServer : public EchoServer
+	{
+	public:
+		WorkServer(const net::TcpServerOptions& options, Clock::duration work) : EchoServer(options), m_work(work)
+		{
+
+		}
+	protected:
+		virtual void HandleMessage() override
+		{
+			net::Message<Protocal> message;
+			while (m_message_queue.TryPopMessageIn(message))
+			{
+				Work();
+				Echo(message);
+			}
+		}
+
+		virtual void HandleWorkerMessage(net::Message<Protocal>& message) override
+		{
+			Work();
+			Echo(message);
+		}
+	private:
+		void Work() const
+		{
+			Clock::time_point end = Clock::now() + m_work;
+			while (Clock::now() < end)
+				net::CpuRelax();
+		}
+
+		Clock::duration m_work;
+	};
+
+	struct LoopbackCase
+	{
+		size_t body_size;
+		size_t connections;
+		size_t threads;
+		// Accept with one SO_REUSEPORT acceptor per server I/O thread, see TcpServerOptions::sharded_accept.
+		bool sharded = false;
+	};
+
+	using ClientConnection = net::Connection<Protocal>;
+
+	// Connects count clients to server one after another, so the server gives them consecutive
+	// ids, on the I/O threads of pool. Received messages go to queue.
+	std::vector<std::shared_ptr<ClientConnection>> ConnectClients(EchoServer& server, net::IoContextPool& pool,
+		net::MessageQueue<Protocal>& queue, size_t count)
+	{
+		tcp::endpoint endpoint(asio::ip::address_v4::loopback(), server.GetPort());
+		std::vector<std::shared_ptr<ClientConnection>> clients;
+		for (size_t i = 0; i < count; ++i)
+		{
+			asio::io_context& io_context = pool.GetIoContext();
+			tcp::socket socket(io_context);
+			socket.connect(endpoint);
+			// The server sets TCP_NODELAY on its side when it accepts, both ends need it.
+			socket.set_option(tcp::no_delay(true));
+			while (server.Accepted() <= i)
+				std::this_thread::yield();
+			clients.push_back(std::make_shared<ClientConnection>(server.ConnectionId(i), io_context, std::move(socket), queue));
+			clients.back()->ReadMessage();
+		}
+		return clients;
+	}
+
+	// Writes the current time into the first bytes of the body of message.
+	void StampSendTime(net::Message<Protocal>& message)
+	{
+		int64_t now = Clock::now().time_since_epoch().count();
+		std::memcpy(message.body.data(), &now, sizeof(now));
+	}
+
+	Clock::duration SinceSendTime(const net::Message<Protocal>& message)
+	{
+		int64_t sent = 0;
+		std::memcpy(&sent, message.body.data(), sizeof(sent));
+		return Clock::now() - Clock::time_point(Clock::duration(sent));
+	}
+
+	// Starts an EchoServer on a free loopback port and connects the clients one after another,
+	// so the server gives them consecutive ids. Every client keeps one message in flight, the
+	// send time is stamped into its body and the round trip is measured when the echo returns.
+	// Runs for duration and reports echoed messages and payload bytes per second and the round
+	// trip percentiles. The clients are plain Connections sharing one I/O pool, TcpClient runs
+	// a thread per connection and would not scale to thousands of connections.
+	void RunLoopback(const LoopbackCase& test, Clock::duration duration)
+	{
+		net::TcpServerOptions options;
+		options.port = 0;
+		options.thread_count = test.threads;
+		options.sharded_accept = test.sharded;
+		EchoServer server(options);
+		std::thread server_thread([&server]() { server.Start(); });
+
+		net::IoContextPool client_pool(test.threads);
+		client_pool.Run();
+		net::MessageQueue<Protocal> client_queue;
+		std::vector<std::shared_ptr<ClientConnection>> clients = ConnectClients(server, client_pool, client_queue, test.connections);
+
+		bench::LatencyRecorder latency;
+		net::Message<Protocal>::body_type body(std::max(test.body_size, sizeof(int64_t)), 7);
+		bench::Stopwatch stopwatch;
+		Clock::time_point end = Clock::now() + duration;
+		for (size_t i = 0; i < clients.size(); ++i)
+		{
+			net::Message<Protocal> message = net::Message<Protocal>::ConstructMessage(Protocal::DATA, server.ConnectionId(i), 0, body);
+			StampSendTime(message);
+			clients[i]->WriteMessage(std::move(message));
+		}
+
+		size_t echoed = 0;
+		net::Message<Protocal> reply;
+		while (Clock::now() < end)
+		{
+			if (!client_queue.TryPopMessageIn(reply))
+			{
+				client_queue.WaitMessageIn(std::chrono::milliseconds(10));
+				continue;
+			}
+			latency.Record(SinceSendTime(reply));
+			echoed += 1;
+
+			size_t index = reply.header.from - server.ConnectionId(0);
+			StampSendTime(reply);
+			clients[index]->WriteMessage(std::move(reply));
+		}
+		double seconds = stopwatch.Seconds();
+
+		server.Stop();
+		server_thread.join();
+		client_pool.Stop();
+		clients.clear();
+
+		bench::Result result;
+		result.name = "loopback_echo";
+		result.parameters = { { "body", test.body_size }, { "connections", test.connections }, { "threads", test.threads },
+			{ "sharded", test.sharded } };
+		result.operations = echoed;
+		result.seconds = seconds;
+		result.bytes = echoed * body.size();
+		result.p50_ns = latency.Percentile(0.5);
+		result.p99_ns = latency.Percentile(0.99);
+		result.p999_ns = latency.Percentile(0.999);
+		bench::Report(result);
+	}
+
+	// Pairs up the clients and relays through the server: the first client of a pair sends a
+	// request with header.dest set to its partner, the partner answers with the ids swapped and
+	// the round trip ends when the answer is back. With route, the server forwards by
+	// header.dest on its I/O threads, otherwise its HandleMessage() forwards through the queue.
+	// Reports completed round trips per second and their latency.
+	void RunRelay(const LoopbackCase& test, bool route, Clock::duration duration)
+	{
+		constexpr size_t KindOffset = sizeof(int64_t);
+		constexpr uint8_t Request = 0;
+		constexpr uint8_t Answer = 1;
+
+		net::TcpServerOptions options;
+		options.port = 0;
+		options.thread_count = test.threads;
+		options.route_by_dest = route;
+		EchoServer server(options);
+		std::thread server_thread([&server]() { server.Start(); });
+
+		net::IoContextPool client_pool(test.threads);
+		client_pool.Run();
+		net::MessageQueue<Protocal> client_queue;
+		std::vector<std::shared_ptr<ClientConnection>> clients = ConnectClients(server, client_pool, client_queue, test.connections);
+
+		bench::LatencyRecorder latency;
+		net::Message<Protocal>::body_type body(std::max(test.body_size, KindOffset + 1), 7);
+		bench::Stopwatch stopwatch;
+		Clock::time_point end = Clock::now() + duration;
+		for (size_t i = 0; i + 1 < clients.size(); i += 2)
+		{
+			net::Message<Protocal> message = net::Message<Protocal>::ConstructMessage(Protocal::DATA,
+				server.ConnectionId(i), server.ConnectionId(i + 1), body);
+			message.body[KindOffset] = Request;
+			StampSendTime(message);
+			clients[i]->WriteMessage(std::move(message));
+		}
+
+		size_t relayed = 0;
+		net::Message<Protocal> message;
+		while (Clock::now() < end)
+		{
+			if (!client_queue.TryPopMessageIn(message))
+			{
+				client_queue.WaitMessageIn(std::chrono::milliseconds(10));
+				continue;
+			}
+			size_t receiver = message.header.dest - server.ConnectionId(0);
+			if (message.body[KindOffset] == Request)
+			{
+				message.body[KindOffset] = Answer;
+			}
+			else
+			{
+				latency.Record(SinceSendTime(message));
+				relayed += 1;
+				message.body[KindOffset] = Request;
+				StampSendTime(message);
+			}
+			std::swap(message.header.from, message.header.dest);
+			clients[receiver]->WriteMessage(std::move(message));
+		}
+		double seconds = stopwatch.Seconds();
+
+		server.Stop();
+		server_thread.join();
+		client_pool.Stop();
+		clients.clear();
+
+		bench::Result result;
+		result.name = route ? "relay routed" : "relay queued";
+		result.parameters = { { "body", test.body_size }, { "connections", test.connections }, { "threads", test.threads } };
+		result.operations = relayed;
+		result.seconds = seconds;
+		result.bytes = relayed * 2 * body.size();
+		result.p50_ns = latency.Percentile(0.5);
+		result.p99_ns = latency.Percentile(0.99);
+		result.p999_ns = latency.Percentile(0.999);
+		bench::Report(result);
+	}
+
+	struct WorkerCase
+	{
+		size_t workers;
+		size_t connections;
+		Clock::duration work;
+	};
+
+	// Echoes through a WorkServer with test.workers worker threads, or with HandleMessage() on one
+	// thread if it is 0. Every client keeps Window numbered messages in flight and checks that
+	// the echoes come back in the order it sent them. Reports echoes per second and the round trip.
+	void RunWorkers(const WorkerCase& test, Clock::duration duration)
+	{
+		constexpr size_t Window = 4;
+		constexpr size_t SequenceOffset = sizeof(int64_t);
+
+		net::TcpServerOptions options;
+		options.port = 0;
+		options.thread_count = 2;
+		options.worker_count = test.workers;
+		WorkServer server(options, test.work);
+		std::thread server_thread([&server]() { server.Start(); });
+
+		net::IoContextPool client_pool(2);
+		client_pool.Run();
+		net::MessageQueue<Protocal> client_queue;
+		std::vector<std::shared_ptr<ClientConnection>> clients = ConnectClients(server, client_pool, client_queue, test.connections);
+
+		std::vector<uint64_t> sent(clients.size(), 0);
+		std::vector<uint64_t> expected(clients.size(), 0);
+		auto send = [&](size_t index)
+		{
+			net::Message<Protocal> message;
+			message.header.protocal = Protocal::DATA;
+			message.header.from = server.ConnectionId(index);
+			message << int64_t(0) << sent[index]++;
+			StampSendTime(message);
+			clients[index]->WriteMessage(std::move(message));
+		};
+
+		bench::LatencyRecorder latency;
+		bench::Stopwatch stopwatch;
+		Clock::time_point end = Clock::now() + duration;
+		for (size_t i = 0; i < clients.size(); ++i)
+		{
+			for (size_t n = 0; n < Window; ++n)
+				send(i);
+		}
+
+		size_t echoed = 0;
+		size_t reordered = 0;
+		net::Message<Protocal> reply;
+		while (Clock::now() < end)
+		{
+			if (!client_queue.TryPopMessageIn(reply))
+			{
+				client_queue.WaitMessageIn(std::chrono::milliseconds(10));
+				continue;
+			}
+			latency.Record(SinceSendTime(reply));
+			echoed += 1;
+
+			size_t index = reply.header.from - server.ConnectionId(0);
+			uint64_t sequence = 0;
+			std::memcpy(&sequence, reply.body.data() + SequenceOffset, sizeof(sequence));
+			if (sequence != expected[index])
+				reordered += 1;
+			expected[index] = sequence + 1;
+			send(index);
+		}
+		double seconds = stopwatch.Seconds();
+
+		server.Stop();
+		server_thread.join();
+		client_pool.Stop();
+		clients.clear();
+
+		if (reordered != 0)
+			std::printf("workers=%zu: %zu echoes out of order\n", test.workers, reordered);
+		bench::Result result;
+		result.name = "workers";
+		result.parameters = { { "workers", test.workers }, { "connections", test.connections },
+			{ "work_us", static_cast<size_t>(std::chrono::duration_cast<std::chrono::microseconds>(test.work).count()) } };
+		result.operations = echoed;
+		result.seconds = seconds;
+		result.p50_ns = latency.Percentile(0.5);
+		result.p99_ns = latency.Percentile(0.99);
+		result.p999_ns = latency.Percentile(0.999);
+		bench::Report(result);
+	}
+}
+
+// Round trips through a real TcpServer over loopback, sweeping message size, connection count
+// and I/O thread count. The default sweep is quick, --full covers 16 B to 1 MiB messages and
+// up to 10k connections, skipping cases that would keep more than 256 MiB in flight. Every
+// case with more than one thread also runs with sharded accept. Thousands of connections need a
+// matching open file limit (ulimit -n).
+NET_BENCHMARK(loopback_echo)
+{
+	using namespace std::chrono_literals;
+	bool full = bench::GetOptions().full;
+	std::vector<size_t> body_sizes = full ? std::vector<size_t>{ 16, 256, 4096, 65536, 1 << 20 } : std::vector<size_t>{ 16, 4096, 65536 };
+	std::vector<size_t> connection_counts = full ? std::vector<size_t>{ 1, 10, 100, 1000, 10000 } : std::vector<size_t>{ 1, 64 };
+	std::vector<size_t> thread_counts = full ? std::vector<size_t>{ 1, 2, 4, 8 } : std::vector<size_t>{ 1, 2 };
+	Clock::duration duration = full ? Clock::duration(2s) : Clock::duration(500ms);
+
+	for (size_t threads : thread_counts)
+	{
+		for (size_t connections : connection_counts)
+		{
+			for (size_t body_size : body_sizes)
+			{
+				if (body_size * connections > (256u << 20))
+					continue;
+				RunLoopback({ body_size, connections, threads }, duration);
+				if (threads > 1)
+					RunLoopback({ body_size, connections, threads, true }, duration);
+			}
+		}
+	}
+}
+
+// Client to client round trips relayed by a TcpServer, forwarded through the message queue and
+// HandleMessage() or routed by header.dest on the I/O threads.
+NET_BENCHMARK(loopback_relay)
+{
+	using namespace std::chrono_literals;
+	bool full = bench::GetOptions().full;
+	std::vector<size_t> body_sizes = full ? std::vector<size_t>{ 16, 1024, 65536 } : std::vector<size_t>{ 16, 4096 };
+	std::vector<size_t> connection_counts = full ? std::vector<size_t>{ 2, 100, 1000 } : std::vector<size_t>{ 2, 64 };
+	std::vector<size_t> thread_counts = full ? std::vector<size_t>{ 1, 2, 4 } : std::vector<size_t>{ 1, 2 };
+	Clock::duration duration = full ? Clock::duration(2s) : Clock::duration(500ms);
+
+	for (size_t threads : thread_counts)
+	{
+		for (size_t connections : connection_counts)
+		{
+			for (size_t body_size : body_sizes)
+			{
+				RunRelay({ body_size, connections, threads }, false, duration);
+				RunRelay({ body_size, connections, threads }, true, duration);
+			}
+		}
+	}
+}
+
+// Echoes with a CPU-heavy handler, on the thread running Start() (0 workers) or spread over a
+// worker pool, keeping the messages of each connection in order.
+NET_BENCHMARK(loopback_workers)
+{
+	using namespace std::chrono_literals;
+	bool full = bench::GetOptions().full;
+	std::vector<size_t> worker_counts = full ? std::vector<size_t>{ 0, 1, 2, 4, 8 } : std::vector<size_t>{ 0, 1, 2, 4 };
+	std::vector<size_t> connection_counts = full ? std::vector<size_t>{ 4, 64, 512 } : std::vector<size_t>{ 16 };
+	std::vector<Clock::duration> works = full ? std::vector<Clock::duration>{ 1us, 20us, 200us } : std::vector<Clock::duration>{ 20us };
+	Clock::duration duration = full ? Clock::duration(2s) : Clock::duration(500ms);
+
+	for (Clock::duration work : works)
+	{
+		for (size_t connections : connection_counts)
+		{
+			for (size_t workers : worker_counts)
+				RunWorkers({ workers, connections, work }, duration);
+		}
+	}
+}
+
+// Cost of one latency probe sample, a clock read and a histogram update. Zero without
+// NET_LATENCY_PROBES. With probes compiled in, first prints the stage latencies recorded by the
+// benchmarks run before it, the samples it takes itself land in the handle stage.
+NET_BENCHMARK(latency_probe)
+{
+	if constexpr (net::probe::Enabled)
+	{
+		for (size_t i = 0; i < static_cast<size_t>(net::probe::Stage::Count); ++i)
+		{
+			net::probe::Stage stage = static_cast<net::probe::Stage>(i);
+			net::probe::HistogramSnapshot snapshot = net::probe::Snapshot(stage);
+			std::printf("stage %-8s samples %10llu mean %10.0f ns p50 %8llu ns p99 %8llu ns p999 %8llu ns\n",
+				net::probe::StageName(stage), static_cast<unsigned long long>(snapshot.total), snapshot.Mean(),
+				static_cast<unsigned long long>(snapshot.Percentile(0.5)), static_cast<unsigned long long>(snapshot.Percentile(0.99)),
+				static_cast<unsigned long long>(snapshot.Percentile(0.999)));
+		}
+	}
+
+	constexpr size_t Samples = 10000000;
+	net::probe::Timestamp timestamp;
+	net::probe::Stamp(timestamp);
+	bench::Stopwatch stopwatch;
+	for (size_t i = 0; i < Samples; ++i)
+		net::probe::Record(net::probe::Stage::Handle, timestamp);
+	bench::Report("probe record", Samples, stopwatch.Seconds());
+}
@@ -0,0 +1,47 @@
+#include <cstring>
+#include "bench.h"
+#include "core.hpp"
+
+// Runs every registered benchmark, or only those whose name contains one of the arguments.
+// --full runs the full parameter sweeps, --json FILE also writes the results to FILE as JSON lines.
+int main(int argc, char* argv[])
+{
+	std::vector<std::string> filters;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string argument = argv[i];
+		if (argument == "--full")
+		{
+			bench::GetOptions().full = true;
+		}
+		else if (argument == "--json" && i + 1 < argc)
+		{
+			bench::GetOptions().json = std::fopen(argv[++i], "w");
+			if (bench::GetOptions().json == nullptr)
+			{
+				std::fprintf(stderr, "Cannot open %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else
+		{
+			filters.push_back(argument);
+		}
+	}
+
+	std::printf("I/O backend: %s\n", net::IoBackend());
+	for (const bench::Benchmark& benchmark : bench::Registry())
+	{
+		bool selected = filters.empty();
+		for (size_t i = 0; i < filters.size() && !selected; ++i)
+			selected = benchmark.name.find(filters[i]) != std::string::npos;
+		if (!selected)
+			continue;
+
+		std::printf("== %s\n", benchmark.name.c_str());
+		benchmark.function();
+	}
+	if (bench::GetOptions().json != nullptr)
+		std::fclose(bench::GetOptions().json);
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include <thread>
+#include "bench.h"
+#include "connection/message_queue.h"
+
+namespace
+{
+	enum class Protocal
+	{
+		DATA
+	};
+
+	constexpr size_t MessagesPerProducer = 200000;
+
+	// Pushes MessagesPerProducer small messages from each producer thread while the calling
+	// thread consumes them with pop, and reports the consumed messages per second.
+	template<typename Queue, typename Pop>
+	void RunProducers(const std::string& name, size_t producers, Pop pop)
+	{
+		Queue queue;
+		net::Message<Protocal> message = net::Message<Protocal>::ConstructMessage(Protocal::DATA, { 42 });
+		size_t total = producers * MessagesPerProducer;
+
+		bench::Stopwatch stopwatch;
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < producers; ++i)
+		{
+			threads.emplace_back([&queue, &message]()
+			{
+				for (size_t n = 0; n < MessagesPerProducer; ++n)
+					queue.WriteMessageIn(message);
+			});
+		}
+
+		size_t consumed = 0;
+		while (consumed < total)
+		{
+			if (pop(queue))
+				consumed += 1;
+		}
+		double seconds = stopwatch.Seconds();
+
+		for (std::thread& thread : threads)
+			thread.join();
+		bench::Report(name + " producers=" + std::to_string(producers), total, seconds);
+	}
+}
+
+// Compares the mutex-guarded queue consumed with the original empty/read/pop sequence, the same
+// queue consumed with TryPopMessageIn(), and the lock-free MpscQueue storage.
+NET_BENCHMARK(message_queue_in)
+{
+	using Locked = net::MessageQueue<Protocal>;
+	using LockFree = net::MessageQueue<Protocal, net::MpscQueue>;
+
+	for (size_t producers : { 1, 2, 4, 8 })
+	{
+		RunProducers<Locked>("locked empty+read+pop", producers, [](Locked& queue)
+		{
+			if (queue.MessageInEmpty())
+				return false;
+			net::Message<Protocal> message = queue.ReadMessageIn();
+			queue.PopMessageIn();
+			return true;
+		});
+
+		RunProducers<Locked>("locked try_pop", producers, [](Locked& queue)
+		{
+			net::Message<Protocal> message;
+			return queue.TryPopMessageIn(message);
+		});
+
+		RunProducers<LockFree>("mpsc try_pop", producers, [](LockFree& queue)
+		{
+			net::Message<Protocal> message;
+			return queue.TryPopMessageIn(message);
+		});
+	}
+}
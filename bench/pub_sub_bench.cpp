@@ -0,0 +1,146 @@
+#include <thread>
+#include "bench.h"
+#include "server/pub_sub.h"
+
+namespace
+{
+	enum class Protocal
+	{
+		SUBSCRIBE,
+		UNSUBSCRIBE,
+		PUBLISH
+	};
+
+	using Clock = std::chrono::steady_clock;
+	using ClientConnection = net::Connection<Protocal>;
+
+	constexpr std::string_view Topic = "bench";
+
+	struct PubSubCase
+	{
+		size_t body_size;
+		size_t subscribers;
+		size_t threads;
+	};
+
+	// Starts a PubSubServer on a free loopback port, subscribes the subscriber clients to one topic
+	// and publishes to it from one more client, keeping a window of publishes in flight. A publish
+	// completes when every subscriber got it. Reports completed publishes per second, the bytes
+	// delivered to all subscribers and the latency from publishing to each delivery.
+	void RunPubSub(const PubSubCase& test, Clock::duration duration)
+	{
+		constexpr size_t Window = 64;
+
+		net::TcpServerOptions options;
+		options.port = 0;
+		options.thread_count = test.threads;
+		net::PubSubServer<Protocal> server({ Protocal::SUBSCRIBE, Protocal::UNSUBSCRIBE, Protocal::PUBLISH }, options);
+		std::thread server_thread([&server]() { server.Start(); });
+
+		net::IoContextPool client_pool(test.threads);
+		client_pool.Run();
+		net::MessageQueue<Protocal> client_queue;
+		tcp::endpoint endpoint(asio::ip::address_v4::loopback(), server.GetPort());
+		auto connect = [&](size_t id)
+		{
+			asio::io_context& io_context = client_pool.GetIoContext();
+			tcp::socket socket(io_context);
+			socket.connect(endpoint);
+			// The server sets TCP_NODELAY on its side when it accepts, both ends need it.
+			socket.set_option(tcp::no_delay(true));
+			auto client = std::make_shared<ClientConnection>(id, io_context, std::move(socket), client_queue);
+			client->ReadMessage();
+			return client;
+		};
+
+		std::vector<std::shared_ptr<ClientConnection>> subscribers;
+		for (size_t i = 0; i < test.subscribers; ++i)
+		{
+			subscribers.push_back(connect(i));
+			subscribers.back()->WriteMessage(net::TopicMessage(Protocal::SUBSCRIBE, Topic));
+		}
+		std::shared_ptr<ClientConnection> publisher = connect(test.subscribers);
+		for (;;)
+		{
+			auto subscribed = server.GetTopics().GetSubscribers(Topic);
+			if (subscribed && subscribed->size() == test.subscribers)
+				break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		auto publish = [&]()
+		{
+			net::Message<Protocal> message = net::TopicMessage(Protocal::PUBLISH, Topic);
+			message << static_cast<int64_t>(Clock::now().time_since_epoch().count());
+			message.body.resize(std::max(message.body.size(), test.body_size));
+			message.header.size = message.body.size();
+			publisher->WriteMessage(std::move(message));
+		};
+
+		bench::LatencyRecorder latency;
+		bench::Stopwatch stopwatch;
+		Clock::time_point end = Clock::now() + duration;
+		size_t published = 0;
+		size_t delivered = 0;
+		size_t delivered_bytes = 0;
+		net::Message<Protocal> message;
+		while (Clock::now() < end)
+		{
+			while (published - delivered / test.subscribers < Window)
+			{
+				publish();
+				published += 1;
+			}
+			if (!client_queue.TryPopMessageIn(message))
+			{
+				client_queue.WaitMessageIn(std::chrono::milliseconds(10));
+				continue;
+			}
+			std::string topic;
+			int64_t sent = 0;
+			message >> topic >> sent;
+			latency.Record(Clock::now() - Clock::time_point(Clock::duration(sent)));
+			delivered += 1;
+			delivered_bytes += message.size_in_bytes();
+		}
+		double seconds = stopwatch.Seconds();
+
+		server.Stop();
+		server_thread.join();
+		client_pool.Stop();
+		subscribers.clear();
+		publisher.reset();
+
+		bench::Result result;
+		result.name = "pub_sub";
+		result.parameters = { { "body", test.body_size }, { "subscribers", test.subscribers }, { "threads", test.threads } };
+		result.operations = delivered / test.subscribers;
+		result.seconds = seconds;
+		result.bytes = delivered_bytes;
+		result.p50_ns = latency.Percentile(0.5);
+		result.p99_ns = latency.Percentile(0.99);
+		result.p999_ns = latency.Percentile(0.999);
+		bench::Report(result);
+	}
+}
+
+// Publishes per second through a PubSubServer over loopback against the number of subscribers
+// of the topic. Every publish is encoded once and fanned out as a shared frame.
+NET_BENCHMARK(pub_sub)
+{
+	using namespace std::chrono_literals;
+	bool full = bench::GetOptions().full;
+	std::vector<size_t> body_sizes = full ? std::vector<size_t>{ 64, 4096 } : std::vector<size_t>{ 64 };
+	std::vector<size_t> subscriber_counts = full ? std::vector<size_t>{ 1, 10, 100, 1000 } : std::vector<size_t>{ 1, 16, 256 };
+	std::vector<size_t> thread_counts = full ? std::vector<size_t>{ 1, 2, 4 } : std::vector<size_t>{ 1, 2 };
+	Clock::duration duration = full ? Clock::duration(2s) : Clock::duration(500ms);
+
+	for (size_t threads : thread_counts)
+	{
+		for (size_t subscribers : subscriber_counts)
+		{
+			for (size_t body_size : body_sizes)
+				RunPubSub({ body_size, subscribers, threads }, duration);
+		}
+	}
+}
@@ -2,7 +2,7 @@
 #include <string_view>
 #include <array>
 #include "core.hpp"
-#include "connection/Connection.h"
+#include "connection/connection.h"
 
 using asio::ip::tcp;
 
@@ -10,7 +10,8 @@ namespace net
 {
 	// It is a template client class that create tcp connection with server. 
 	// Protocal is the common communication rules between server and clients.
-	template<Protocal T>
+	// Queue stores the messages received from the server, see MessageQueue.
+	template<Protocal T, typename Queue = MessageQueue<T>>
 	class TcpClient
 	{
 	public:
@@ -25,28 +26,28 @@ namespace net
 		// This function should not be overriden.
 		void Disconnect();
 	protected:
-		std::shared_ptr<Connection<T>> m_connection;
-		MessageQueue<T> m_messages_queue;
+		std::shared_ptr<Connection<T, Queue>> m_connection;
+		Queue m_messages_queue;
 		size_t m_id;
 	private:
 		asio::io_context m_io_context;
 		std::thread m_thread;
 	};
 
-	template<Protocal T>
-	TcpClient<T>::TcpClient() : m_io_context(), m_messages_queue()
+	template<Protocal T, typename Queue>
+	TcpClient<T, Queue>::TcpClient() : m_io_context(), m_messages_queue()
 	{
 
 	}
 
-	template<Protocal T>
-	bool TcpClient<T>::Connect(const std::string_view& host, const std::string_view& port)
+	template<Protocal T, typename Queue>
+	bool TcpClient<T, Queue>::Connect(const std::string_view& host, const std::string_view& port)
 	{
 		try
 		{
 			tcp::resolver resolver(m_io_context);
 			tcp::resolver::results_type endpoints = resolver.resolve(host, port);
-			m_connection = std::make_shared<Connection<T>>(-1, m_io_context, tcp::socket(m_io_context), m_messages_queue);
+			m_connection = std::make_shared<Connection<T, Queue>>(-1, m_io_context, tcp::socket(m_io_context), m_messages_queue);
 			m_connection->ConnectToServer(endpoints);
 			m_thread = std::thread([this]() { m_io_context.run(); });
 			return true;
@@ -59,8 +60,8 @@ namespace net
 		}
 	}
 
-	template<Protocal T>
-	void TcpClient<T>::Disconnect()
+	template<Protocal T, typename Queue>
+	void TcpClient<T, Queue>::Disconnect()
 	{
 		m_connection->Disconnect();
 		if (m_thread.joinable())
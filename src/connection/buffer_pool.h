@@ -0,0 +1,348 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+#include "core.hpp"
+
+namespace net
+{
+	// Counters of the buffer pool. A hit is an allocation served from a cached block, a miss had
+	// to call operator new. Oversized allocations are larger than the biggest size class and
+	// always bypass the pool.
+	struct BufferPoolStats
+	{
+		uint64_t allocations = 0;
+		uint64_t hits = 0;
+		uint64_t oversized = 0;
+		uint64_t deallocations = 0;
+
+		// Returns the share of allocations served from the pool, between 0 and 1.
+		double HitRate() const
+		{
+			return allocations == 0 ? 0.0 : static_cast<double>(hits) / allocations;
+		}
+	};
+
+	// A per-thread cache of memory blocks in power-of-two size classes from 64 B to 1 MB, used for
+	// message bodies. Freed blocks are kept on the freeing thread's free list of their class and
+	// handed out again by the next allocation of that class on that thread, so steady-state
+	// traffic does not reach the heap. Bodies are often allocated on an I/O thread and freed on
+	// an application thread, so once a thread caches more than MaxCachedBytes of a class, half of
+	// its list is moved as one batch to a shared depot, where threads that run out take it from.
+	// The depot holds at most GetMaxDepotBytes() per class, further blocks go back to the heap.
+	// In the worst case the pool keeps ClassCount * MaxCachedBytes (15 MiB) per thread plus
+	// ClassCount * GetMaxDepotBytes() (60 MiB by default) in the depots.
+	class BufferPool
+	{
+	public:
+		static constexpr size_t MinClassShift = 6;
+		static constexpr size_t MaxClassShift = 20;
+		static constexpr size_t ClassCount = MaxClassShift - MinClassShift + 1;
+		static constexpr size_t MaxCachedBytes = 1024 * 1024;
+		static constexpr size_t DefaultMaxDepotBytes = 4 * 1024 * 1024;
+
+		static void* Allocate(size_t bytes);
+		static void Deallocate(void* block, size_t bytes);
+		// Returns the counters summed over all threads, including threads that have exited.
+		static BufferPoolStats GetStats();
+		// Returns the counters of the calling thread.
+		static BufferPoolStats GetThreadStats();
+		// Set how many bytes of free blocks the depot of each size class holds at most. A smaller
+		// value keeps less memory when traffic drops, but sends more blocks back to the heap.
+		// Blocks already in the depot stay there until they are taken.
+		static void SetMaxDepotBytes(size_t bytes);
+		static size_t GetMaxDepotBytes();
+	private:
+		struct FreeBlock
+		{
+			FreeBlock* next;
+		};
+
+		// Only the owning thread writes, with AddSingleWriter().
+		struct Counters
+		{
+			std::atomic<uint64_t> allocations{ 0 };
+			std::atomic<uint64_t> hits{ 0 };
+			std::atomic<uint64_t> oversized{ 0 };
+			std::atomic<uint64_t> deallocations{ 0 };
+
+			void AddTo(BufferPoolStats& stats) const
+			{
+				stats.allocations += allocations.load(std::memory_order_relaxed);
+				stats.hits += hits.load(std::memory_order_relaxed);
+				stats.oversized += oversized.load(std::memory_order_relaxed);
+				stats.deallocations += deallocations.load(std::memory_order_relaxed);
+			}
+		};
+
+		// A linked list of free blocks of one size class.
+		struct Batch
+		{
+			FreeBlock* head = nullptr;
+			size_t count = 0;
+		};
+
+		class ThreadCache
+		{
+		public:
+			ThreadCache();
+			~ThreadCache();
+			void* Allocate(size_t size_class);
+			void Deallocate(void* block, size_t size_class);
+			Counters counters;
+		private:
+			std::array<Batch, ClassCount> m_free{};
+		};
+
+		// Batches of free blocks moved out of thread caches, per size class.
+		struct Depot
+		{
+			std::mutex mutex;
+			std::vector<Batch> batches;
+			size_t bytes = 0;
+		};
+
+		// All live thread caches, the counters of the caches of exited threads and the depots.
+		struct Registry
+		{
+			std::mutex mutex;
+			std::vector<ThreadCache*> caches;
+			BufferPoolStats retired;
+			std::array<Depot, ClassCount> depots;
+			std::atomic<size_t> max_depot_bytes{ DefaultMaxDepotBytes };
+		};
+
+		static Registry& GetRegistry();
+		// Returns the calling thread's cache, or nullptr while the thread is exiting.
+		static ThreadCache* GetThreadCache();
+		// Returns the size class index that fits bytes, or ClassCount if bytes is oversized.
+		static size_t SizeClass(size_t bytes);
+		static size_t ClassSize(size_t size_class);
+		// Moves batch into the depot of its class. Returns false if the depot is full.
+		static bool PushBatch(size_t size_class, Batch batch);
+		// Takes a batch out of the depot of its class. Returns false if the depot is empty.
+		static bool PopBatch(size_t size_class, Batch& batch);
+		static void FreeBatch(Batch batch);
+	};
+
+	inline void* BufferPool::Allocate(size_t bytes)
+	{
+		size_t size_class = SizeClass(bytes);
+		ThreadCache* cache = GetThreadCache();
+		if (cache == nullptr)
+			return ::operator new(size_class < ClassCount ? ClassSize(size_class) : bytes);
+
+		AddSingleWriter(cache->counters.allocations);
+		if (size_class == ClassCount)
+		{
+			AddSingleWriter(cache->counters.oversized);
+			return ::operator new(bytes);
+		}
+		return cache->Allocate(size_class);
+	}
+
+	inline void BufferPool::Deallocate(void* block, size_t bytes)
+	{
+		size_t size_class = SizeClass(bytes);
+		ThreadCache* cache = GetThreadCache();
+		if (cache == nullptr || size_class == ClassCount)
+		{
+			if (cache != nullptr)
+				AddSingleWriter(cache->counters.deallocations);
+			::operator delete(block);
+			return;
+		}
+		AddSingleWriter(cache->counters.deallocations);
+		cache->Deallocate(block, size_class);
+	}
+
+	inline BufferPoolStats BufferPool::GetStats()
+	{
+		Registry& registry = GetRegistry();
+		std::scoped_lock lock(registry.mutex);
+		BufferPoolStats stats = registry.retired;
+		for (const ThreadCache* cache : registry.caches)
+			cache->counters.AddTo(stats);
+		return stats;
+	}
+
+	inline BufferPoolStats BufferPool::GetThreadStats()
+	{
+		BufferPoolStats stats;
+		if (ThreadCache* cache = GetThreadCache())
+			cache->counters.AddTo(stats);
+		return stats;
+	}
+
+	inline void BufferPool::SetMaxDepotBytes(size_t bytes)
+	{
+		GetRegistry().max_depot_bytes.store(bytes, std::memory_order_relaxed);
+	}
+
+	inline size_t BufferPool::GetMaxDepotBytes()
+	{
+		return GetRegistry().max_depot_bytes.load(std::memory_order_relaxed);
+	}
+
+	inline BufferPool::Registry& BufferPool::GetRegistry()
+	{
+		// Never destroyed, thread caches may unregister during static destruction.
+		static Registry* registry = new Registry();
+		return *registry;
+	}
+
+	inline BufferPool::ThreadCache* BufferPool::GetThreadCache()
+	{
+		thread_local bool destroyed = false;
+		struct Holder
+		{
+			ThreadCache cache;
+			bool& destroyed;
+			~Holder() { destroyed = true; }
+		};
+		if (destroyed)
+			return nullptr;
+		thread_local Holder holder{ {}, destroyed };
+		return &holder.cache;
+	}
+
+	inline size_t BufferPool::SizeClass(size_t bytes)
+	{
+		size_t size_class = 0;
+		size_t size = size_t(1) << MinClassShift;
+		while (size < bytes && size_class < ClassCount)
+		{
+			size <<= 1;
+			size_class += 1;
+		}
+		return size_class;
+	}
+
+	inline size_t BufferPool::ClassSize(size_t size_class)
+	{
+		return size_t(1) << (size_class + MinClassShift);
+	}
+
+	inline bool BufferPool::PushBatch(size_t size_class, Batch batch)
+	{
+		Depot& depot = GetRegistry().depots[size_class];
+		size_t bytes = batch.count * ClassSize(size_class);
+		size_t max_bytes = GetMaxDepotBytes();
+		std::scoped_lock lock(depot.mutex);
+		if (depot.bytes + bytes > max_bytes)
+			return false;
+		depot.batches.push_back(batch);
+		depot.bytes += bytes;
+		return true;
+	}
+
+	inline bool BufferPool::PopBatch(size_t size_class, Batch& batch)
+	{
+		Depot& depot = GetRegistry().depots[size_class];
+		std::scoped_lock lock(depot.mutex);
+		if (depot.batches.empty())
+			return false;
+		batch = depot.batches.back();
+		depot.batches.pop_back();
+		depot.bytes -= batch.count * ClassSize(size_class);
+		return true;
+	}
+
+	inline void BufferPool::FreeBatch(Batch batch)
+	{
+		while (batch.head != nullptr)
+		{
+			FreeBlock* next = batch.head->next;
+			::operator delete(batch.head);
+			batch.head = next;
+		}
+	}
+
+	inline BufferPool::ThreadCache::ThreadCache()
+	{
+		Registry& registry = GetRegistry();
+		std::scoped_lock lock(registry.mutex);
+		registry.caches.push_back(this);
+	}
+
+	inline BufferPool::ThreadCache::~ThreadCache()
+	{
+		for (size_t size_class = 0; size_class < ClassCount; ++size_class)
+		{
+			if (m_free[size_class].count > 0 && !PushBatch(size_class, m_free[size_class]))
+				FreeBatch(m_free[size_class]);
+		}
+
+		Registry& registry = GetRegistry();
+		std::scoped_lock lock(registry.mutex);
+		counters.AddTo(registry.retired);
+		std::erase(registry.caches, this);
+	}
+
+	inline void* BufferPool::ThreadCache::Allocate(size_t size_class)
+	{
+		Batch& free = m_free[size_class];
+		if (free.head == nullptr && !PopBatch(size_class, free))
+			return ::operator new(ClassSize(size_class));
+
+		AddSingleWriter(counters.hits);
+		FreeBlock* block = free.head;
+		free.head = block->next;
+		free.count -= 1;
+		return block;
+	}
+
+	inline void BufferPool::ThreadCache::Deallocate(void* block, size_t size_class)
+	{
+		Batch& free = m_free[size_class];
+		FreeBlock* free_block = static_cast<FreeBlock*>(block);
+		free_block->next = free.head;
+		free.head = free_block;
+		free.count += 1;
+		if (free.count == 1 || free.count * ClassSize(size_class) <= MaxCachedBytes)
+			return;
+
+		// Keep the first half of the list, move the second half out.
+		Batch batch;
+		batch.count = free.count / 2;
+		FreeBlock* last_kept = free.head;
+		for (size_t i = 1; i < free.count - batch.count; ++i)
+			last_kept = last_kept->next;
+		batch.head = last_kept->next;
+		last_kept->next = nullptr;
+		free.count -= batch.count;
+		if (!PushBatch(size_class, batch))
+			FreeBatch(batch);
+	}
+
+	// A standard allocator drawing from BufferPool, used for message bodies.
+	template<typename U>
+	class BufferAllocator
+	{
+	public:
+		using value_type = U;
+
+		BufferAllocator() noexcept = default;
+		template<typename V>
+		BufferAllocator(const BufferAllocator<V>&) noexcept {}
+
+		U* allocate(size_t count)
+		{
+			return static_cast<U*>(BufferPool::Allocate(count * sizeof(U)));
+		}
+
+		void deallocate(U* block, size_t count) noexcept
+		{
+			BufferPool::Deallocate(block, count * sizeof(U));
+		}
+
+		template<typename V>
+		bool operator==(const BufferAllocator<V>&) const noexcept
+		{
+			return true;
+		}
+	};
+}
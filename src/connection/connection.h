@@ -1,150 +1,418 @@
 #pragma once
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
 #include "core.hpp"
+#include "connection_stats.h"
+#include "latency_probe.h"
 #include "message_queue.h"
+#include "read_buffer.h"
+#include "router.h"
+#include "shared_frame.h"
+#include "wire_format.h"
 
 using asio::ip::tcp;
 
 namespace net
 {
-	template<Protocal T>
-	class Connection : public std::enable_shared_from_this<Connection<T>>
+	// Returns true for the errors every connection ends with: the peer closing or resetting it,
+	// or its own socket being closed while operations were pending. They are not logged.
+	inline bool IsDisconnectError(const asio::error_code& error)
+	{
+		return error == asio::error::eof || error == asio::error::operation_aborted || error == asio::error::bad_descriptor
+			|| error == asio::error::connection_reset || error == asio::error::broken_pipe;
+	}
+
+	// Returns true for the errors of a connection closed in an orderly way by either side, they
+	// are not counted in ConnectionStats::errors.
+	inline bool IsOrderlyCloseError(const asio::error_code& error)
+	{
+		return error == asio::error::eof || error == asio::error::operation_aborted || error == asio::error::bad_descriptor;
+	}
+
+	// Queue is the message queue that received messages are delivered to, MessageQueue<T> or
+	// a MessageQueue with another storage such as MpscQueue.
+	// A connection must be owned by a std::shared_ptr. Every pending operation holds a reference
+	// to it, and all its handlers run on a per-connection strand, so it stays valid until the last
+	// handler has run even if it is disconnected and released meanwhile, and it may be used with
+	// an io_context run by several threads.
+	template<Protocal T, typename Queue = MessageQueue<T>>
+	class Connection : public std::enable_shared_from_this<Connection<T, Queue>>
 	{
 	public:
-		Connection(size_t id, asio::io_context& io_context, tcp::socket socket, MessageQueue<T>& messageQueue);
+		Connection(size_t id, asio::io_context& io_context, tcp::socket socket, Queue& messageQueue);
 		// Perform an asynchronous connection to the endpoints, ConnectionHandler will be called if connection is successful.
+		// The connected socket gets TCP_NODELAY like the sockets accepted by TcpServer.
 		void ConnectToServer(const tcp::resolver::results_type& endpoints);
 		void ConnectToClient();
+		// Close the socket on the connection's strand, pending operations finish with an error.
 		void Disconnect();
 		void ReadMessage();
+		// Queue a message to be sent, may be called from any thread. The write itself runs on the
+		// connection's strand and is only started if none is in progress or scheduled, so frames
+		// never interleave. The first overload copies message, the second takes over its body, so
+		// a message popped from the message queue can be sent back without a copy.
 		void WriteMessage(const Message<T>& message);
+		void WriteMessage(Message<T>&& message);
+		// Queue a frame that is sent by several connections, only a reference to it is queued.
+		// Same ordering guarantees as WriteMessage().
+		void WriteFrame(SharedFramePtr<T> frame);
+		// Queue a frame another connection received, header followed by the header.size body
+		// elements at body. Header and body are copied into one buffer, sent with a single write.
+		void ForwardFrame(const Header<T>& header, const uint8_t* body);
+		// Forward every received frame whose header.dest is the id of another connection in router
+		// straight to that connection, on this connection's I/O thread, instead of delivering it to
+		// the message queue. Frames for unknown ids still go to the queue. The connection removes
+		// itself from router when it is closed. Call it before ReadMessage().
+		void SetRouter(std::shared_ptr<Router<T, Queue>> router);
+		// Overwrite header.from of every received message with the id of this connection, both those
+		// delivered to the message queue and those forwarded by the router, so neither the
+		// application nor another client can be told a wrong sender. Call it before ReadMessage().
+		void SetStampSender(bool stamp);
+		// Set the limits used when gathering queued messages into one write. Call it before the
+		// first message is written.
+		void SetWriteBatchOptions(const WriteBatchOptions& options);
+		// Set the largest message body in bytes accepted from the peer, wire::DefaultMaxBodyBytes
+		// by default. A frame announcing a larger body fails with protocol_error and disconnects,
+		// before anything is allocated for it. Call it before ReadMessage().
+		void SetMaxBodySize(size_t bytes);
 		bool IsOpen() const;
 		size_t GetId() const;
+		// Returns a copy of the traffic counters of this connection, may be called from any thread.
+		ConnectionStats GetStats() const;
+		// Returns the live counters, they stay valid after the connection is destroyed.
+		std::shared_ptr<const ConnectionCounters> GetCounters() const;
 	protected:
-		// Perform an asynchronous read and write operation from the connection
-		virtual void ReadMessageHeader();
+		// Size of the per-connection receive buffer. Frames larger than this are received by a
+		// dedicated read straight into the message body.
+		static constexpr size_t ReadBufferSize = 64 * 1024;
+		// Perform an asynchronous read and write operation from the connection.
+		// Read as many bytes as are available into the receive buffer.
+		virtual void ReadFrames();
+		// Read the rest of an oversized message body directly into the body of message in.
 		virtual void ReadMessageBody();
-		virtual void WriteMessageHeader();
-		virtual void WriteMessageBody();
+		// Move every complete frame in the receive buffer into the message queue. Returns true if
+		// an oversized frame was started in message in and its body has to be read by ReadMessageBody().
+		// Sets error if the buffer holds a malformed header.
+		virtual bool ParseFrames(asio::error_code& error);
+		// Gather queued outgoing messages, up to the batch limits, into one buffer sequence (header
+		// and body of each frame back to back) and send them with a single asynchronous write.
+		// Shared frames contribute their already encoded header.
+		virtual void WriteMessageFrames();
 		// Callback function when connection succeed.
 		virtual void ConnectionHandler(const asio::error_code& error, const tcp::endpoint& endpoint);
-		// If header is received successfully, resize the buffer size of the body of message in, 
-		// and start waiting the message body. Otherwise, discard current message and wait for next message header.
-		virtual void ReadHeaderHandler(const asio::error_code& error, size_t bytes_transferred);
-		// If body is received successfully, add the received message to the message queue. Then wait 
-		// for the next message header. Otherwise, discard current message and wait for next message header.
+		// If bytes are received successfully, parse all complete frames out of the receive buffer,
+		// then keep reading. If error occurred, disconnect current connection.
+		virtual void ReadFramesHandler(const asio::error_code& error, size_t bytes_transferred);
+		// If the oversized body is received successfully, add the message to the message queue and
+		// go back to buffered reading. If error occurred, disconnect current connection.
 		virtual void ReadBodyHandler(const asio::error_code& error, size_t bytes_transferred);
-		// If header is sent successfully, send the message body.
-		// Otherwise, resent current message header. If error occurred, diconnect current connection.
-		virtual void WriteHeaderHandler(const asio::error_code& error, size_t bytes_transferred);
-		// If body is sent successfully, send next message header.
-		// Otherwise, resent current message header until client received. If error occurred,
-		// disconnect current connection.
-		virtual void WriteBodyHandler(const asio::error_code& error, size_t bytes_transferred);
+		// If the frames are sent successfully, release them and send the next batch of queued
+		// messages. If error occurred, disconnect current connection.
+		virtual void WriteFramesHandler(const asio::error_code& error, size_t bytes_transferred);
+		// Flush the messages collected during the flush delay.
+		virtual void FlushTimerHandler(const asio::error_code& error);
+		// Append frame to the outgoing queue and start a write on the strand if none is requested yet.
+		void QueueFrame(OutgoingFrame<T>&& frame);
+		// Start writing the queued messages, immediately or after the flush delay. Runs on the strand.
+		void StartWrite();
+		// Moves the messages waiting to be sent into the messages of the next write, stopping at the
+		// batch limits. At least one message is taken if any is queued. Returns the number taken.
+		size_t TakeMessagesOut();
+		// Shut down and close the socket, must run on the strand.
+		void CloseSocket();
+		// Count an error unless the connection was closed in an orderly way, and log it unless it is
+		// a disconnect, see IsDisconnectError().
 		void LogError(const asio::error_code& error, const std::string_view& functor);
 	protected:
 		size_t m_id;
 	private:
 		asio::io_context& m_io_context;
+		std::shared_ptr<ConnectionCounters> m_counters;
+		asio::strand<asio::io_context::executor_type> m_strand;
 		tcp::socket m_socket;
+		ReadBuffer m_read_buffer;
+		// When the last read completed, the frames parsed from it start their latency probes there.
+		NET_NO_UNIQUE_ADDRESS probe::Timestamp m_read_time;
+		// Resolves header.dest of received frames, if set.
+		std::shared_ptr<Router<T, Queue>> m_router;
+		bool m_stamp_sender;
+		size_t m_max_body_bytes;
+		// Oversized message being received, and how many bytes of its body have arrived.
 		Message<T> m_message_in;
-		Message<T> m_message_out;
-		MessageQueue<T>& m_message_queue;
+		size_t m_body_received;
+		// Messages waiting to be sent by this connection only. m_write_requested is set while a
+		// write is scheduled or in flight on the strand, which will pick up every queued message.
+		// m_closed is set by CloseSocket(), after which nothing is queued any more.
+		std::deque<OutgoingFrame<T>> m_queue_out;
+		std::mutex m_queue_out_mutex;
+		bool m_write_requested;
+		bool m_closed;
+		// Messages of the write in flight, their encoded headers and the buffers pointing into them.
+		// These and the write state below are only accessed on the strand.
+		std::vector<OutgoingFrame<T>> m_messages_out;
+		std::vector<uint8_t> m_headers_out;
+		std::vector<asio::const_buffer> m_write_buffers;
+		bool m_writing;
+		WriteBatchOptions m_batch_options;
+		asio::steady_timer m_flush_timer;
+		bool m_flush_pending;
+		Queue& m_message_queue;
 	};
 
-	template<Protocal T>
-	Connection<T>::Connection(size_t id, asio::io_context& io_context, tcp::socket socket, MessageQueue<T>& messageQueue) :
-		m_id(id), m_io_context(io_context), m_socket(std::move(socket)), m_message_in(), m_message_out(), m_message_queue(messageQueue)
+	template<Protocal T, typename Queue>
+	Connection<T, Queue>::Connection(size_t id, asio::io_context& io_context, tcp::socket socket, Queue& messageQueue) :
+		m_id(id), m_io_context(io_context), m_counters(std::make_shared<ConnectionCounters>()), m_strand(asio::make_strand(io_context)), m_socket(std::move(socket)),
+		m_read_buffer(ReadBufferSize), m_router(), m_stamp_sender(false), m_max_body_bytes(wire::DefaultMaxBodyBytes), m_message_in(), m_body_received(0), m_queue_out(), m_write_requested(false), m_closed(false), m_messages_out(), m_headers_out(), m_write_buffers(), m_writing(false),
+		m_batch_options(), m_flush_timer(io_context), m_flush_pending(false), m_message_queue(messageQueue)
 	{
 
 	}
 
-	template<Protocal T>
-	void Connection<T>::ConnectToServer(const tcp::resolver::results_type& endpoints)
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::ConnectToServer(const tcp::resolver::results_type& endpoints)
 	{
-		asio::async_connect(m_socket, endpoints,
-			std::bind(&Connection::ConnectionHandler, this, std::placeholders::_1, std::placeholders::_2));
+		asio::async_connect(m_socket, endpoints, asio::bind_executor(m_strand,
+			std::bind(&Connection::ConnectionHandler, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2)));
 	}
 
-	template<Protocal T>
-	void Connection<T>::ConnectToClient()
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::ConnectToClient()
 	{
 
 	}
 
-	template<Protocal T>
-	inline void Connection<T>::Disconnect()
+	template<Protocal T, typename Queue>
+	inline void Connection<T, Queue>::Disconnect()
 	{
-		asio::error_code error;
-		m_socket.shutdown(tcp::socket::shutdown_both, error);
-		m_socket.close(error);
-		if (error)
-			std::cerr << "Disconnect Error: " << error.message() << std::endl;
+		asio::dispatch(m_strand, std::bind(&Connection::CloseSocket, this->shared_from_this()));
+	}
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::ReadMessage()
+	{
+		asio::dispatch(m_strand, std::bind(&Connection::ReadFrames, this->shared_from_this()));
+	}
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::WriteMessage(const Message<T>& message)
+	{
+		WriteMessage(Message<T>(message));
+	}
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::WriteMessage(Message<T>&& message)
+	{
+		probe::Record(probe::Stage::Handle, message.timestamp);
+		QueueFrame(OutgoingFrame<T>{ std::move(message), nullptr });
+	}
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::WriteFrame(SharedFramePtr<T> frame)
+	{
+		OutgoingFrame<T> entry;
+		entry.shared = std::move(frame);
+		probe::Stamp(entry.message.timestamp);
+		QueueFrame(std::move(entry));
+	}
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::ForwardFrame(const Header<T>& header, const uint8_t* body)
+	{
+		using byte = typename Message<T>::byte;
+		size_t body_bytes = header.size * sizeof(byte);
+		OutgoingFrame<T> entry;
+		entry.message.header = header;
+		entry.message.body.resize((wire::MaxHeaderSize<T> + body_bytes + sizeof(byte) - 1) / sizeof(byte));
+		uint8_t* frame = reinterpret_cast<uint8_t*>(entry.message.body.data());
+		size_t header_bytes = wire::EncodeHeader(header, frame);
+		if (body_bytes != 0)
+			std::memcpy(frame + header_bytes, body, body_bytes);
+		entry.encoded_size = header_bytes + body_bytes;
+		probe::Stamp(entry.message.timestamp);
+		QueueFrame(std::move(entry));
+	}
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::SetRouter(std::shared_ptr<Router<T, Queue>> router)
+	{
+		m_router = std::move(router);
+	}
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::SetStampSender(bool stamp)
+	{
+		m_stamp_sender = stamp;
+	}
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::QueueFrame(OutgoingFrame<T>&& frame)
+	{
+		bool start;
+		{
+			std::scoped_lock lock(m_queue_out_mutex);
+			// A closed connection never writes again, the frame is dropped.
+			if (m_closed)
+				return;
+			m_queue_out.push_back(std::move(frame));
+			m_counters->UpdateQueueDepth(m_queue_out.size());
+			start = !m_write_requested;
+			m_write_requested = true;
+		}
+		if (start)
+			asio::dispatch(m_strand, std::bind(&Connection::StartWrite, this->shared_from_this()));
 	}
 
-	template<Protocal T>
-	void Connection<T>::ReadMessage()
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::SetWriteBatchOptions(const WriteBatchOptions& options)
 	{
-		ReadMessageHeader();
+		m_batch_options = options;
 	}
 
-	template<Protocal T>
-	void Connection<T>::WriteMessage(const Message<T>& message)
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::SetMaxBodySize(size_t bytes)
 	{
-		m_message_queue.WriteMessageOut(message);
-		WriteMessageHeader();
+		m_max_body_bytes = bytes;
 	}
 
-	template<Protocal T>
-	bool Connection<T>::IsOpen() const
+	template<Protocal T, typename Queue>
+	bool Connection<T, Queue>::IsOpen() const
 	{
 		return m_socket.is_open();
 	}
 
-	template<Protocal T>
-	size_t Connection<T>::GetId() const
+	template<Protocal T, typename Queue>
+	size_t Connection<T, Queue>::GetId() const
 	{
 		return m_id;
 	}
 
-	template<Protocal T>
-	void Connection<T>::ReadMessageHeader()
+	template<Protocal T, typename Queue>
+	ConnectionStats Connection<T, Queue>::GetStats() const
+	{
+		return m_counters->Snapshot();
+	}
+
+	template<Protocal T, typename Queue>
+	std::shared_ptr<const ConnectionCounters> Connection<T, Queue>::GetCounters() const
+	{
+		return m_counters;
+	}
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::ReadFrames()
+	{
+		m_socket.async_read_some(m_read_buffer.Prepare(), asio::bind_executor(m_strand,
+			std::bind(&Connection::ReadFramesHandler, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2)));
+	}
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::ReadMessageBody()
 	{
-		asio::async_read(m_socket, asio::buffer(&m_message_in.header, sizeof(Header<T>)),
-			std::bind(&Connection::ReadHeaderHandler, this, std::placeholders::_1, std::placeholders::_2));
+		uint8_t* body = reinterpret_cast<uint8_t*>(m_message_in.body.data());
+		asio::mutable_buffer rest = asio::buffer(body + m_body_received, m_message_in.size_in_bytes() - m_body_received);
+		asio::async_read(m_socket, rest, asio::bind_executor(m_strand,
+			std::bind(&Connection::ReadBodyHandler, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2)));
 	}
 
-	template<Protocal T>
-	void Connection<T>::ReadMessageBody()
+	template<Protocal T, typename Queue>
+	bool Connection<T, Queue>::ParseFrames(asio::error_code& error)
 	{
-		asio::async_read(m_socket, asio::buffer(m_message_in.body.data(), m_message_in.body.size() * sizeof(Message<T>::byte)),
-			std::bind(&Connection::ReadBodyHandler, this, std::placeholders::_1, std::placeholders::_2));
+		size_t parsed = 0;
+		// Snapshot of the routing table, taken by the first frame with a destination.
+		std::shared_ptr<const typename Router<T, Queue>::Table> routes;
+		while (m_read_buffer.Size() > 0)
+		{
+			FrameInfo<T> frame;
+			FrameStatus status = PeekFrame(m_read_buffer, frame, m_max_body_bytes);
+			if (status == FrameStatus::Incomplete)
+				break;
+			if (status == FrameStatus::Malformed)
+			{
+				error = std::make_error_code(std::errc::protocol_error);
+				break;
+			}
+			if (status == FrameStatus::Oversized)
+			{
+				// The frame can never fit, take what has arrived and read the rest separately.
+				m_body_received = TakeFrame(m_read_buffer, frame, m_message_in);
+				m_counters->AddIn(0, parsed);
+				return true;
+			}
+
+			if (m_stamp_sender)
+				frame.header.from = m_id;
+			const Header<T>& header = frame.header;
+			if (m_router && header.dest != 0 && header.dest != m_id)
+			{
+				if (!routes)
+					routes = m_router->GetTable();
+				if (std::shared_ptr<Connection> target = Router<T, Queue>::Find(*routes, header.dest))
+				{
+					target->ForwardFrame(header, m_read_buffer.Data() + frame.header_bytes);
+					m_read_buffer.Consume(frame.FrameBytes());
+					parsed += 1;
+					continue;
+				}
+			}
+
+			Message<T> message;
+			TakeFrame(m_read_buffer, frame, message);
+			message.timestamp = m_read_time;
+			m_message_queue.WriteMessageIn(std::move(message));
+			parsed += 1;
+		}
+		m_counters->AddIn(0, parsed);
+		return false;
 	}
 
-	template<Protocal T>
-	void Connection<T>::WriteMessageHeader()
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::StartWrite()
 	{
-		if (!m_message_queue.MessageOutEmpty())
+		if (m_writing || m_flush_pending)
+			return;
+
+		if (m_batch_options.flush_delay.count() > 0)
+		{
+			m_flush_pending = true;
+			m_flush_timer.expires_after(m_batch_options.flush_delay);
+			m_flush_timer.async_wait(asio::bind_executor(m_strand,
+				std::bind(&Connection::FlushTimerHandler, this->shared_from_this(), std::placeholders::_1)));
+		}
+		else
 		{
-			m_message_out = m_message_queue.ReadMessageOut();
-			asio::async_write(m_socket, asio::buffer(&m_message_out.header, sizeof(Header<T>)),
-				std::bind(&Connection::WriteHeaderHandler, this, std::placeholders::_1, std::placeholders::_2));
+			WriteMessageFrames();
 		}
 	}
 
-	template<Protocal T>
-	void Connection<T>::WriteMessageBody()
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::WriteMessageFrames()
 	{
-		asio::async_write(m_socket, asio::buffer(m_message_out.body.data(), m_message_out.body.size() * sizeof(Message<T>::byte)),
-			std::bind(&Connection::WriteBodyHandler, this, std::placeholders::_1, std::placeholders::_2));
+		m_messages_out.clear();
+		m_write_buffers.clear();
+		if (TakeMessagesOut() == 0)
+		{
+			m_writing = false;
+			return;
+		}
+
+		m_writing = true;
+		GatherFrames(m_messages_out, m_headers_out, m_write_buffers);
+		asio::async_write(m_socket, m_write_buffers, asio::bind_executor(m_strand,
+			std::bind(&Connection::WriteFramesHandler, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2)));
 	}
 
-	template<Protocal T>
-	void Connection<T>::ConnectionHandler(const asio::error_code& error, const tcp::endpoint& endpoint)
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::ConnectionHandler(const asio::error_code& error, const tcp::endpoint& endpoint)
 	{
 		if (!error)
 		{
+			// Same as on accepted sockets, WriteBatchOptions replaces kernel Nagle.
+			asio::error_code ignored;
+			m_socket.set_option(tcp::no_delay(true), ignored);
 			ReadMessage();
 		}
 		else
@@ -153,38 +421,61 @@ namespace net
 		}
 	}
 	
-	template<Protocal T>
-	void Connection<T>::ReadHeaderHandler(const asio::error_code& error, size_t bytes_transferred)
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::ReadFramesHandler(const asio::error_code& error, size_t bytes_transferred)
 	{
 		if (!error)
 		{
-			if (bytes_transferred == sizeof(Header<T>))
+			probe::Stamp(m_read_time);
+			m_counters->AddIn(bytes_transferred, 0);
+			m_read_buffer.Commit(bytes_transferred);
+			asio::error_code parse_error;
+			bool oversized = ParseFrames(parse_error);
+			if (parse_error)
+			{
+				LogError(parse_error, "ParseFrames");
+				Disconnect();
+			}
+			else if (oversized)
 			{
-				m_message_in.body.resize(m_message_in.header.size);
 				ReadMessageBody();
 			}
 			else
 			{
-				ReadMessageHeader();
+				ReadFrames();
 			}
 		}
 		else
 		{
-			LogError(error, "ReadHeaderHandler");
+			LogError(error, "ReadFramesHandler");
 			Disconnect();
 		}
 	}
 
-	template<Protocal T>
-	void Connection<T>::ReadBodyHandler(const asio::error_code& error, size_t bytes_transferred)
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::ReadBodyHandler(const asio::error_code& error, size_t bytes_transferred)
 	{
 		if (!error)
 		{
-			if (m_message_in.size_in_bytes() == bytes_transferred)
+			probe::Stamp(m_message_in.timestamp);
+			m_counters->AddIn(bytes_transferred, 1);
+			if (m_stamp_sender)
+				m_message_in.header.from = m_id;
+			// An oversized frame is no longer in one piece, a routed one is sent on as a message.
+			std::shared_ptr<Connection> target;
+			if (m_router && m_message_in.header.dest != 0 && m_message_in.header.dest != m_id)
+				target = Router<T, Queue>::Find(*m_router->GetTable(), m_message_in.header.dest);
+			if (target)
+			{
+				target->WriteMessage(std::move(m_message_in));
+			}
+			else
 			{
-				m_message_queue.WriteMessageIn(m_message_in);
+				m_message_queue.WriteMessageIn(std::move(m_message_in));
 			}
-			ReadMessageHeader();
+			m_message_in = Message<T>();
+			m_body_received = 0;
+			ReadFrames();
 		}
 		else
 		{
@@ -193,48 +484,80 @@ namespace net
 		}
 	}
 
-	template<Protocal T>
-	void Connection<T>::WriteHeaderHandler(const asio::error_code& error, size_t bytes_transferred)
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::WriteFramesHandler(const asio::error_code& error, size_t bytes_transferred)
 	{
 		if (!error)
 		{
-			if (bytes_transferred == sizeof(Header<T>))
-			{
-				WriteMessageBody();
-			}
-			else
+			m_counters->AddOut(bytes_transferred, m_messages_out.size());
+			if constexpr (probe::Enabled)
 			{
-				WriteMessageHeader();
+				for (OutgoingFrame<T>& frame : m_messages_out)
+					probe::Record(probe::Stage::Write, frame.message.timestamp);
 			}
+			WriteMessageFrames();
 		}
-		else if (error)
+		else
 		{
-			LogError(error, "WriteHeaderHandler");
+			m_writing = false;
+			LogError(error, "WriteFramesHandler");
 			Disconnect();
 		}
 	}
 
-	template<Protocal T>
-	void Connection<T>::WriteBodyHandler(const asio::error_code& error, size_t bytes_transferred)
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::FlushTimerHandler(const asio::error_code& error)
 	{
-		if (!error)
+		m_flush_pending = false;
+		if (!error && !m_writing)
 		{
-			if (m_message_out.size_in_bytes() == bytes_transferred)
-			{
-				m_message_queue.PopMessageOut();
-			}
-			WriteMessageHeader();
+			WriteMessageFrames();
 		}
-		else if (error)
+	}
+
+	template<Protocal T, typename Queue>
+	size_t Connection<T, Queue>::TakeMessagesOut()
+	{
+		std::scoped_lock lock(m_queue_out_mutex);
+		size_t count = TakeFrames(m_queue_out, m_messages_out, m_batch_options);
+		// Nothing left to write, the next WriteMessage() has to start a write again.
+		if (count == 0)
+			m_write_requested = false;
+		else if (!m_queue_out.empty())
+			m_counters->AddWriteStall();
+		return count;
+	}
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::CloseSocket()
+	{
+		bool was_closed;
 		{
-			LogError(error, "WriteBodyHandler");
-			Disconnect();
+			// Release the frames that will never be written and refuse new ones.
+			std::scoped_lock lock(m_queue_out_mutex);
+			was_closed = m_closed;
+			m_closed = true;
+			m_queue_out.clear();
+			m_write_requested = false;
 		}
+		// Nothing can be forwarded to a closed connection any more.
+		if (m_router && !was_closed)
+			m_router->Remove(m_id);
+		asio::error_code error;
+		m_flush_timer.cancel();
+		m_socket.shutdown(tcp::socket::shutdown_both, error);
+		m_socket.close(error);
+		if (error)
+			std::cerr << "Disconnect Error: " << error.message() << std::endl;
 	}
-	template<Protocal T>
-	void Connection<T>::LogError(const asio::error_code& error, const std::string_view& functor)
+
+	template<Protocal T, typename Queue>
+	void Connection<T, Queue>::LogError(const asio::error_code& error, const std::string_view& functor)
 	{
-		std::cerr << "ID[" << m_id << "] " << functor << " Error: " << error.message() << std::endl;
+		if (!IsOrderlyCloseError(error))
+			m_counters->AddError();
+		if (!IsDisconnectError(error))
+			std::cerr << "ID[" << m_id << "] " << functor << " Error: " << error.message() << std::endl;
 	}
 }
 
@@ -0,0 +1,111 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include "core.hpp"
+
+namespace net
+{
+	// A plain copy of the counters of one or more connections.
+	struct ConnectionStats
+	{
+		uint64_t bytes_in = 0;
+		uint64_t messages_in = 0;
+		uint64_t bytes_out = 0;
+		uint64_t messages_out = 0;
+		// Largest number of messages waiting in the outgoing queue.
+		uint64_t queue_high_water = 0;
+		// Writes that could not take every queued message because of the batch limits, i.e. the
+		// socket did not keep up with the messages being queued.
+		uint64_t write_stalls = 0;
+		// Failed operations other than the peer closing the connection.
+		uint64_t errors = 0;
+
+		ConnectionStats& operator+=(const ConnectionStats& other)
+		{
+			bytes_in += other.bytes_in;
+			messages_in += other.messages_in;
+			bytes_out += other.bytes_out;
+			messages_out += other.messages_out;
+			queue_high_water = std::max(queue_high_water, other.queue_high_water);
+			write_stalls += other.write_stalls;
+			errors += other.errors;
+			return *this;
+		}
+	};
+
+	// The live counters of one connection. Each group is written by one side only, the read
+	// path, the write path or WriteMessage() under the outgoing queue lock, and sits on its own
+	// cache line so the sides do not contend. Any thread may take a Snapshot().
+	class ConnectionCounters
+	{
+	public:
+		static constexpr size_t CacheLineSize = 64;
+
+		void AddIn(uint64_t bytes, uint64_t messages)
+		{
+			AddSingleWriter(m_in.bytes, bytes);
+			AddSingleWriter(m_in.messages, messages);
+		}
+
+		void AddOut(uint64_t bytes, uint64_t messages)
+		{
+			AddSingleWriter(m_out.bytes, bytes);
+			AddSingleWriter(m_out.messages, messages);
+		}
+
+		void AddWriteStall()
+		{
+			AddSingleWriter(m_out.write_stalls);
+		}
+
+		void AddError()
+		{
+			AddSingleWriter(m_out.errors);
+		}
+
+		void UpdateQueueDepth(uint64_t depth)
+		{
+			if (depth > m_queue.high_water.load(std::memory_order_relaxed))
+				m_queue.high_water.store(depth, std::memory_order_relaxed);
+		}
+
+		ConnectionStats Snapshot() const
+		{
+			ConnectionStats stats;
+			stats.bytes_in = m_in.bytes.load(std::memory_order_relaxed);
+			stats.messages_in = m_in.messages.load(std::memory_order_relaxed);
+			stats.bytes_out = m_out.bytes.load(std::memory_order_relaxed);
+			stats.messages_out = m_out.messages.load(std::memory_order_relaxed);
+			stats.write_stalls = m_out.write_stalls.load(std::memory_order_relaxed);
+			stats.errors = m_out.errors.load(std::memory_order_relaxed);
+			stats.queue_high_water = m_queue.high_water.load(std::memory_order_relaxed);
+			return stats;
+		}
+	private:
+		// Every counter has a single writer and is updated with AddSingleWriter().
+		struct alignas(CacheLineSize) In
+		{
+			std::atomic<uint64_t> bytes{ 0 };
+			std::atomic<uint64_t> messages{ 0 };
+		};
+
+		struct alignas(CacheLineSize) Out
+		{
+			std::atomic<uint64_t> bytes{ 0 };
+			std::atomic<uint64_t> messages{ 0 };
+			std::atomic<uint64_t> write_stalls{ 0 };
+			std::atomic<uint64_t> errors{ 0 };
+		};
+
+		struct alignas(CacheLineSize) Queue
+		{
+			std::atomic<uint64_t> high_water{ 0 };
+		};
+
+		In m_in;
+		Out m_out;
+		Queue m_queue;
+	};
+}
@@ -0,0 +1,349 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include "core.hpp"
+#include "connection.h"
+#include "connection_stats.h"
+#include "latency_probe.h"
+#include "message_queue.h"
+#include "read_buffer.h"
+#include "shared_frame.h"
+#include "wire_format.h"
+
+using asio::ip::tcp;
+
+namespace net
+{
+	// An alternative to Connection built on C++20 coroutines. It speaks the same wire format and
+	// offers the same connecting, reading, writing, batching and statistics members, but has no
+	// ConnectToClient(), ForwardFrame(), SetRouter() or SetStampSender(), so it cannot route frames
+	// or stamp the sender. Instead of a chain of virtual handlers, the read and write state
+	// machines are two plain loops, a reader and a writer. Both run as coroutines on the
+	// connection's strand. Coroutine frames are recycled by Asio's per-thread frame cache, and the
+	// completion handler of each loop is allocated from asio::recycling_allocator, so a running
+	// connection does not allocate per operation.
+	// Like Connection, it must be owned by a std::shared_ptr.
+	template<Protocal T, typename Queue = MessageQueue<T>>
+	class CoroConnection : public std::enable_shared_from_this<CoroConnection<T, Queue>>
+	{
+	public:
+		CoroConnection(size_t id, asio::io_context& io_context, tcp::socket socket, Queue& messageQueue);
+		// Perform an asynchronous connection to the endpoints, and start reading once connected.
+		void ConnectToServer(const tcp::resolver::results_type& endpoints);
+		// Close the socket on the connection's strand, both loops finish with an error.
+		void Disconnect();
+		// Start the reader loop.
+		void ReadMessage();
+		// Queue a message to be sent, may be called from any thread. Wakes the writer loop if it is idle.
+		void WriteMessage(const Message<T>& message);
+		void WriteMessage(Message<T>&& message);
+		// Queue a frame that is sent by several connections, only a reference to it is queued.
+		void WriteFrame(SharedFramePtr<T> frame);
+		// Set the limits used when gathering queued messages into one write. Call it before the
+		// first message is written.
+		void SetWriteBatchOptions(const WriteBatchOptions& options);
+		// Set the largest message body in bytes accepted from the peer, see Connection::SetMaxBodySize().
+		void SetMaxBodySize(size_t bytes);
+		bool IsOpen() const;
+		size_t GetId() const;
+		// Returns a copy of the traffic counters of this connection, may be called from any thread.
+		ConnectionStats GetStats() const;
+		// Returns the live counters, they stay valid after the connection is destroyed.
+		std::shared_ptr<const ConnectionCounters> GetCounters() const;
+	protected:
+		static constexpr size_t ReadBufferSize = 64 * 1024;
+		// Read from the socket and deliver every complete frame to the message queue until an error occurs.
+		asio::awaitable<void> ReaderLoop();
+		// Wait for queued messages and write them in gathered batches until an error occurs.
+		asio::awaitable<void> WriterLoop();
+		// Append frame to the outgoing queue and wake or start the writer loop.
+		void QueueFrame(OutgoingFrame<T>&& frame);
+		// Spawn loop on the strand, the connection is disconnected when the loop ends with an error.
+		void Spawn(asio::awaitable<void> loop, std::string_view name);
+		// Shut down and close the socket, must run on the strand.
+		void CloseSocket();
+		// Count an error unless the connection was closed in an orderly way, and log it unless it is
+		// a disconnect, see IsDisconnectError().
+		void LogError(const asio::error_code& error, const std::string_view& functor);
+	protected:
+		size_t m_id;
+	private:
+		std::shared_ptr<ConnectionCounters> m_counters;
+		asio::strand<asio::io_context::executor_type> m_strand;
+		tcp::socket m_socket;
+		ReadBuffer m_read_buffer;
+		// Messages waiting to be sent. m_writer_idle is set while the writer loop waits on m_wake,
+		// m_closed once CloseSocket() ran, after which nothing is queued any more.
+		std::deque<OutgoingFrame<T>> m_queue_out;
+		std::mutex m_queue_out_mutex;
+		bool m_writer_started;
+		bool m_writer_idle;
+		bool m_closed;
+		asio::steady_timer m_wake;
+		WriteBatchOptions m_batch_options;
+		size_t m_max_body_bytes;
+		Queue& m_message_queue;
+	};
+
+	template<Protocal T, typename Queue>
+	CoroConnection<T, Queue>::CoroConnection(size_t id, asio::io_context& io_context, tcp::socket socket, Queue& messageQueue) :
+		m_id(id), m_counters(std::make_shared<ConnectionCounters>()), m_strand(asio::make_strand(io_context)), m_socket(std::move(socket)), m_read_buffer(ReadBufferSize),
+		m_queue_out(), m_writer_started(false), m_writer_idle(false), m_closed(false), m_wake(m_strand), m_batch_options(), m_max_body_bytes(wire::DefaultMaxBodyBytes), m_message_queue(messageQueue)
+	{
+
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::ConnectToServer(const tcp::resolver::results_type& endpoints)
+	{
+		auto self = this->shared_from_this();
+		Spawn([](std::shared_ptr<CoroConnection> self, tcp::resolver::results_type endpoints) -> asio::awaitable<void>
+		{
+			co_await asio::async_connect(self->m_socket, endpoints, asio::use_awaitable);
+			self->ReadMessage();
+		}(self, endpoints), "ConnectToServer");
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::Disconnect()
+	{
+		asio::dispatch(m_strand, std::bind(&CoroConnection::CloseSocket, this->shared_from_this()));
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::ReadMessage()
+	{
+		Spawn(ReaderLoop(), "ReaderLoop");
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::WriteMessage(const Message<T>& message)
+	{
+		WriteMessage(Message<T>(message));
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::WriteMessage(Message<T>&& message)
+	{
+		probe::Record(probe::Stage::Handle, message.timestamp);
+		QueueFrame(OutgoingFrame<T>{ std::move(message), nullptr });
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::WriteFrame(SharedFramePtr<T> frame)
+	{
+		OutgoingFrame<T> entry;
+		entry.shared = std::move(frame);
+		probe::Stamp(entry.message.timestamp);
+		QueueFrame(std::move(entry));
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::QueueFrame(OutgoingFrame<T>&& frame)
+	{
+		bool start = false;
+		bool wake = false;
+		{
+			std::scoped_lock lock(m_queue_out_mutex);
+			// A closed connection never writes again, the frame is dropped.
+			if (m_closed)
+				return;
+			m_queue_out.push_back(std::move(frame));
+			m_counters->UpdateQueueDepth(m_queue_out.size());
+			start = !m_writer_started;
+			wake = m_writer_idle;
+			m_writer_started = true;
+			m_writer_idle = false;
+		}
+		if (start)
+		{
+			Spawn(WriterLoop(), "WriterLoop");
+		}
+		else if (wake)
+		{
+			asio::dispatch(m_strand, [self = this->shared_from_this()]() { self->m_wake.cancel(); });
+		}
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::SetWriteBatchOptions(const WriteBatchOptions& options)
+	{
+		m_batch_options = options;
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::SetMaxBodySize(size_t bytes)
+	{
+		m_max_body_bytes = bytes;
+	}
+
+	template<Protocal T, typename Queue>
+	bool CoroConnection<T, Queue>::IsOpen() const
+	{
+		return m_socket.is_open();
+	}
+
+	template<Protocal T, typename Queue>
+	size_t CoroConnection<T, Queue>::GetId() const
+	{
+		return m_id;
+	}
+
+	template<Protocal T, typename Queue>
+	ConnectionStats CoroConnection<T, Queue>::GetStats() const
+	{
+		return m_counters->Snapshot();
+	}
+
+	template<Protocal T, typename Queue>
+	std::shared_ptr<const ConnectionCounters> CoroConnection<T, Queue>::GetCounters() const
+	{
+		return m_counters;
+	}
+
+	template<Protocal T, typename Queue>
+	asio::awaitable<void> CoroConnection<T, Queue>::ReaderLoop()
+	{
+		auto self = this->shared_from_this();
+		while (true)
+		{
+			size_t bytes_transferred = co_await m_socket.async_read_some(m_read_buffer.Prepare(), asio::use_awaitable);
+			m_read_buffer.Commit(bytes_transferred);
+			m_counters->AddIn(bytes_transferred, 0);
+			probe::Timestamp read_time;
+			probe::Stamp(read_time);
+
+			while (m_read_buffer.Size() > 0)
+			{
+				FrameInfo<T> frame;
+				FrameStatus status = PeekFrame(m_read_buffer, frame, m_max_body_bytes);
+				if (status == FrameStatus::Incomplete)
+					break;
+				if (status == FrameStatus::Malformed)
+					throw asio::system_error(std::make_error_code(std::errc::protocol_error));
+
+				// Copy what has arrived, an oversized body is completed by a dedicated read.
+				Message<T> message;
+				message.timestamp = read_time;
+				size_t buffered = TakeFrame(m_read_buffer, frame, message);
+				if (buffered < frame.body_bytes)
+				{
+					uint8_t* body = reinterpret_cast<uint8_t*>(message.body.data());
+					size_t rest = co_await asio::async_read(m_socket, asio::buffer(body + buffered, frame.body_bytes - buffered), asio::use_awaitable);
+					probe::Stamp(message.timestamp);
+					m_counters->AddIn(rest, 0);
+				}
+				m_message_queue.WriteMessageIn(std::move(message));
+				m_counters->AddIn(0, 1);
+			}
+		}
+	}
+
+	template<Protocal T, typename Queue>
+	asio::awaitable<void> CoroConnection<T, Queue>::WriterLoop()
+	{
+		auto self = this->shared_from_this();
+		std::vector<OutgoingFrame<T>> messages;
+		std::vector<uint8_t> headers;
+		std::vector<asio::const_buffer> buffers;
+		asio::steady_timer flush_timer(m_strand);
+		while (true)
+		{
+			bool idle;
+			{
+				std::scoped_lock lock(m_queue_out_mutex);
+				idle = m_queue_out.empty();
+				m_writer_idle = idle;
+			}
+			if (idle)
+			{
+				// Sleep until WriteMessage() cancels the wait.
+				asio::error_code error;
+				m_wake.expires_at(asio::steady_timer::time_point::max());
+				co_await m_wake.async_wait(asio::redirect_error(asio::use_awaitable, error));
+				if (!m_socket.is_open())
+					co_return;
+				if (m_batch_options.flush_delay.count() > 0)
+				{
+					flush_timer.expires_after(m_batch_options.flush_delay);
+					co_await flush_timer.async_wait(asio::use_awaitable);
+				}
+				continue;
+			}
+
+			messages.clear();
+			{
+				std::scoped_lock lock(m_queue_out_mutex);
+				TakeFrames(m_queue_out, messages, m_batch_options);
+				if (!m_queue_out.empty())
+					m_counters->AddWriteStall();
+			}
+
+			buffers.clear();
+			GatherFrames(messages, headers, buffers);
+			size_t written = co_await asio::async_write(m_socket, buffers, asio::use_awaitable);
+			m_counters->AddOut(written, messages.size());
+			if constexpr (probe::Enabled)
+			{
+				for (OutgoingFrame<T>& frame : messages)
+					probe::Record(probe::Stage::Write, frame.message.timestamp);
+			}
+		}
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::Spawn(asio::awaitable<void> loop, std::string_view name)
+	{
+		asio::co_spawn(m_strand, std::move(loop), asio::bind_allocator(asio::recycling_allocator<void>(),
+			[self = this->shared_from_this(), name](std::exception_ptr exception)
+			{
+				if (!exception)
+					return;
+				try
+				{
+					std::rethrow_exception(exception);
+				}
+				catch (const asio::system_error& e)
+				{
+					self->LogError(e.code(), name);
+				}
+				catch (const std::exception& e)
+				{
+					self->m_counters->AddError();
+					std::cerr << "ID[" << self->m_id << "] " << name << " Error: " << e.what() << std::endl;
+				}
+				self->CloseSocket();
+			}));
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::CloseSocket()
+	{
+		{
+			// Release the frames that will never be written and refuse new ones.
+			std::scoped_lock lock(m_queue_out_mutex);
+			m_closed = true;
+			m_queue_out.clear();
+		}
+		asio::error_code error;
+		m_wake.cancel();
+		m_socket.shutdown(tcp::socket::shutdown_both, error);
+		m_socket.close(error);
+		if (error)
+			std::cerr << "Disconnect Error: " << error.message() << std::endl;
+	}
+
+	template<Protocal T, typename Queue>
+	void CoroConnection<T, Queue>::LogError(const asio::error_code& error, const std::string_view& functor)
+	{
+		if (!IsOrderlyCloseError(error))
+			m_counters->AddError();
+		if (!IsDisconnectError(error))
+			std::cerr << "ID[" << m_id << "] " << functor << " Error: " << error.message() << std::endl;
+	}
+}
@@ -0,0 +1,134 @@
+#pragma once
+#include <array>
+#include <functional>
+#include <type_traits>
+#include "core.hpp"
+#include "message_queue.h"
+
+namespace net
+{
+	// Binds the handler function to the messages whose header.protocal is value, for Dispatcher.
+	// Function is a function pointer, a pointer to a member function of the context or a lambda
+	// without captures.
+	template<auto Value, auto Function>
+	struct Handler
+	{
+		static constexpr auto protocal = Value;
+		static constexpr auto function = Function;
+	};
+
+	// Calls the handler registered for the protocal of a message, chosen at compile time from
+	// Handlers, a list of Handler. The handlers are known to the compiler, so every call is a
+	// direct call it can inline, and the comparisons compile to the same code as a switch.
+	// Each protocal value may have one handler at most.
+	template<Protocal T, typename... Handlers>
+	class Dispatcher
+	{
+	public:
+		// Calls the handler of message.header.protocal with args followed by message, e.g. the
+		// object of a member function. Returns false if no handler is registered for it.
+		template<typename... Args>
+		static bool Dispatch(Message<T>& message, Args&... args);
+		// Returns true if a handler is registered for protocal.
+		static constexpr bool Handles(T protocal);
+	private:
+		// Compares protocal with the handlers in order, an if else chain the compiler turns into a
+		// jump table like it does with a switch.
+		template<typename First, typename... Rest, typename... Args>
+		static bool Select(T protocal, Message<T>& message, Args&... args);
+		static constexpr bool Unique();
+	};
+
+	// A MessageQueue that hands every received message with a handler in Table, a Dispatcher,
+	// straight to it on the I/O thread that received it, instead of queueing it. Handlers are
+	// called with the context and the message and may run on several I/O threads at once.
+	// Messages without a handler are queued as usual. Use it as the Queue of TcpServer or Connection.
+	template<Protocal T, typename Table, typename Context, template<typename> class Storage = LockedQueue>
+	class DispatchQueue : public MessageQueue<T, Storage>
+	{
+	public:
+		DispatchQueue();
+		// Set the context the handlers are called with. Until it is set every message is queued.
+		// Call it before any connection starts reading.
+		void SetContext(Context* context);
+		void WriteMessageIn(const Message<T>& message);
+		void WriteMessageIn(Message<T>&& message);
+	private:
+		Context* m_context;
+	};
+
+	template<Protocal T, typename... Handlers>
+	template<typename... Args>
+	bool Dispatcher<T, Handlers...>::Dispatch(Message<T>& message, Args&... args)
+	{
+		static_assert((std::is_same_v<std::remove_cv_t<decltype(Handlers::protocal)>, T> && ...),
+			"every handler must be registered for a value of the protocal");
+		static_assert(Unique(), "a protocal value has more than one handler");
+		if constexpr (sizeof...(Handlers) == 0)
+			return false;
+		else
+			return Select<Handlers...>(message.header.protocal, message, args...);
+	}
+
+	template<Protocal T, typename... Handlers>
+	template<typename First, typename... Rest, typename... Args>
+	bool Dispatcher<T, Handlers...>::Select(T protocal, Message<T>& message, Args&... args)
+	{
+		if (protocal == First::protocal)
+		{
+			std::invoke(First::function, args..., message);
+			return true;
+		}
+		else if constexpr (sizeof...(Rest) != 0)
+		{
+			return Select<Rest...>(protocal, message, args...);
+		}
+		return false;
+	}
+
+	template<Protocal T, typename... Handlers>
+	constexpr bool Dispatcher<T, Handlers...>::Handles(T protocal)
+	{
+		return ((protocal == Handlers::protocal) || ...);
+	}
+
+	template<Protocal T, typename... Handlers>
+	constexpr bool Dispatcher<T, Handlers...>::Unique()
+	{
+		std::array<T, sizeof...(Handlers)> values{ Handlers::protocal... };
+		for (size_t i = 0; i < values.size(); ++i)
+		{
+			for (size_t j = i + 1; j < values.size(); ++j)
+			{
+				if (values[i] == values[j])
+					return false;
+			}
+		}
+		return true;
+	}
+
+	template<Protocal T, typename Table, typename Context, template<typename> class Storage>
+	DispatchQueue<T, Table, Context, Storage>::DispatchQueue() : MessageQueue<T, Storage>(), m_context(nullptr)
+	{
+
+	}
+
+	template<Protocal T, typename Table, typename Context, template<typename> class Storage>
+	void DispatchQueue<T, Table, Context, Storage>::SetContext(Context* context)
+	{
+		m_context = context;
+	}
+
+	template<Protocal T, typename Table, typename Context, template<typename> class Storage>
+	void DispatchQueue<T, Table, Context, Storage>::WriteMessageIn(const Message<T>& message)
+	{
+		WriteMessageIn(Message<T>(message));
+	}
+
+	template<Protocal T, typename Table, typename Context, template<typename> class Storage>
+	void DispatchQueue<T, Table, Context, Storage>::WriteMessageIn(Message<T>&& message)
+	{
+		if (m_context == nullptr || !Table::Dispatch(message, *m_context))
+			MessageQueue<T, Storage>::WriteMessageIn(std::move(message));
+	}
+}
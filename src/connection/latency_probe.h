@@ -0,0 +1,207 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "core.hpp"
+
+#if defined(_MSC_VER)
+#define NET_NO_UNIQUE_ADDRESS [[msvc::no_unique_address]]
+#else
+#define NET_NO_UNIQUE_ADDRESS [[no_unique_address]]
+#endif
+
+namespace net::probe
+{
+	// Latency probes follow every frame through the library and record how long it spent in each
+	// stage. They are compiled in by defining NET_LATENCY_PROBES, otherwise every probe point is an
+	// empty inline function and Timestamp is an empty member, so they cost nothing.
+	// Samples go to per-thread histograms without any locking, Snapshot() merges all of them.
+#ifdef NET_LATENCY_PROBES
+	constexpr bool Enabled = true;
+#else
+	constexpr bool Enabled = false;
+#endif
+
+	enum class Stage
+	{
+		// From the socket read completing to the frame being pushed into the message queue.
+		Parse,
+		// From the push into the message queue to the application popping the frame.
+		Queue,
+		// From the application popping a frame to sending it again with WriteMessage().
+		Handle,
+		// From WriteMessage() to the socket write of the frame completing.
+		Write,
+		Count
+	};
+
+	inline const char* StageName(Stage stage)
+	{
+		switch (stage)
+		{
+		case Stage::Parse: return "parse";
+		case Stage::Queue: return "queue";
+		case Stage::Handle: return "handle";
+		case Stage::Write: return "write";
+		default: return "unknown";
+		}
+	}
+
+	// The time a frame passed its last probe point, in steady clock nanoseconds. Zero means the
+	// frame was not stamped, e.g. a message created by the application.
+	struct Timestamp
+	{
+#ifdef NET_LATENCY_PROBES
+		uint64_t ns = 0;
+#endif
+	};
+
+	// A log-linear histogram in the style of HdrHistogram. Values below SubBuckets are counted
+	// exactly, larger values in buckets of 1/SubBuckets relative width, about 3% precision up to
+	// the full uint64_t range. Only the owning thread records, any thread may read the counts.
+	class LatencyHistogram
+	{
+	public:
+		static constexpr uint32_t SubBucketBits = 5;
+		static constexpr uint64_t SubBuckets = uint64_t(1) << SubBucketBits;
+		static constexpr size_t BucketCount = (64 - SubBucketBits + 1) * SubBuckets;
+
+		void Record(uint64_t value)
+		{
+			AddSingleWriter(m_counts[BucketIndex(value)]);
+			AddSingleWriter(m_total);
+			AddSingleWriter(m_sum, value);
+		}
+
+		static size_t BucketIndex(uint64_t value)
+		{
+			if (value < SubBuckets)
+				return static_cast<size_t>(value);
+			uint32_t shift = static_cast<uint32_t>(std::bit_width(value)) - 1 - SubBucketBits;
+			return (shift + 1) * SubBuckets + ((value >> shift) & (SubBuckets - 1));
+		}
+
+		// Returns the largest value counted in bucket index.
+		static uint64_t BucketUpperBound(size_t index)
+		{
+			if (index < SubBuckets)
+				return index;
+			uint64_t shift = index / SubBuckets - 1;
+			uint64_t sub_bucket = index % SubBuckets;
+			return ((SubBuckets + sub_bucket + 1) << shift) - 1;
+		}
+	private:
+		friend struct HistogramSnapshot;
+
+		std::array<std::atomic<uint64_t>, BucketCount> m_counts{};
+		std::atomic<uint64_t> m_total{ 0 };
+		std::atomic<uint64_t> m_sum{ 0 };
+	};
+
+	// The merged counts of one stage at the time Snapshot() was called, in nanoseconds.
+	struct HistogramSnapshot
+	{
+		std::vector<uint64_t> counts = std::vector<uint64_t>(LatencyHistogram::BucketCount);
+		uint64_t total = 0;
+		uint64_t sum = 0;
+
+		void Add(const LatencyHistogram& histogram)
+		{
+			for (size_t i = 0; i < counts.size(); ++i)
+				counts[i] += histogram.m_counts[i].load(std::memory_order_relaxed);
+			total += histogram.m_total.load(std::memory_order_relaxed);
+			sum += histogram.m_sum.load(std::memory_order_relaxed);
+		}
+
+		double Mean() const
+		{
+			return total == 0 ? 0 : static_cast<double>(sum) / total;
+		}
+
+		// Returns the value below which the fraction p of the samples lie, rounded up to its bucket.
+		// p of 1 returns the bucket of the largest sample.
+		uint64_t Percentile(double p) const
+		{
+			if (total == 0)
+				return 0;
+			uint64_t rank = std::min(static_cast<uint64_t>(p * total), total - 1);
+			uint64_t seen = 0;
+			for (size_t i = 0; i < counts.size(); ++i)
+			{
+				seen += counts[i];
+				if (seen > rank)
+					return LatencyHistogram::BucketUpperBound(i);
+			}
+			return 0;
+		}
+	};
+
+	// The histograms of one thread. They are owned by the registry and outlive the thread, so
+	// its samples stay in the snapshots.
+	struct ThreadHistograms
+	{
+		std::array<LatencyHistogram, static_cast<size_t>(Stage::Count)> stages;
+	};
+
+	struct Registry
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<ThreadHistograms>> threads;
+	};
+
+	inline Registry& GetRegistry()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	inline ThreadHistograms& LocalHistograms()
+	{
+		thread_local ThreadHistograms* local = []()
+		{
+			Registry& registry = GetRegistry();
+			std::scoped_lock lock(registry.mutex);
+			registry.threads.push_back(std::make_unique<ThreadHistograms>());
+			return registry.threads.back().get();
+		}();
+		return *local;
+	}
+
+	// Merges the histograms of all threads for stage. Empty if the probes are not compiled in.
+	inline HistogramSnapshot Snapshot(Stage stage)
+	{
+		HistogramSnapshot snapshot;
+		Registry& registry = GetRegistry();
+		std::scoped_lock lock(registry.mutex);
+		for (const std::unique_ptr<ThreadHistograms>& thread : registry.threads)
+			snapshot.Add(thread->stages[static_cast<size_t>(stage)]);
+		return snapshot;
+	}
+
+	// Marks that a frame passed a probe point now.
+	inline void Stamp([[maybe_unused]] Timestamp& timestamp)
+	{
+#ifdef NET_LATENCY_PROBES
+		timestamp.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	// Records the time since timestamp as a sample of stage and stamps it again, so the next
+	// stage starts where this one ended. Frames that were never stamped are only stamped.
+	inline void Record([[maybe_unused]] Stage stage, [[maybe_unused]] Timestamp& timestamp)
+	{
+#ifdef NET_LATENCY_PROBES
+		uint64_t since = timestamp.ns;
+		Stamp(timestamp);
+		if (since != 0 && timestamp.ns >= since)
+			LocalHistograms().stages[static_cast<size_t>(stage)].Record(timestamp.ns - since);
+#endif
+	}
+}
@@ -1,7 +1,19 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <mutex>
 #include <queue>
+#include <stdexcept>
+#include <string_view>
 #include "core.hpp"
+#include "buffer_pool.h"
+#include "latency_probe.h"
+#include "mpsc_queue.h"
 
 namespace net
 {
@@ -14,54 +26,128 @@ namespace net
 		T protocal;
 	};
 
+	// The body of a message is a plain byte buffer. Defining NET_LEGACY_MESSAGE_BODY switches
+	// back to the old layout where every body element is a size_t, for code that depends on it.
+	// It does not restore the old header encoding, so it does not let a build talk to peers built
+	// before the varint headers. The typed operators below work in both layouts, but in the legacy
+	// layout every value is padded to a whole number of size_t elements.
+	// Bodies are allocated from the calling thread's BufferPool.
 	template<Protocal T>
 	struct Message
 	{
+#ifdef NET_LEGACY_MESSAGE_BODY
 		using byte = size_t;
+#else
+		using byte = uint8_t;
+#endif
+		using body_type = std::vector<byte, BufferAllocator<byte>>;
 
 		Header<T> header;
-		std::vector<byte> body;
+		body_type body;
+		// Position in the body of the next value read by operator>>, in bytes.
+		size_t cursor = 0;
+		// When the message passed its last latency probe, empty unless NET_LATENCY_PROBES is defined.
+		NET_NO_UNIQUE_ADDRESS probe::Timestamp timestamp;
 
 		// Factory method for constructing message in a easier way
-		static Message<T> ConstructMessage(T protocal, size_t from, size_t dest, const std::vector<byte>& data)
+		static Message<T> ConstructMessage(T protocal, size_t from, size_t dest, body_type data)
 		{
 			Message<T> message;
 			message.header.protocal = protocal;
 			message.header.from = from;
 			message.header.dest = dest;
-			message.body = data;
 			message.header.size = data.size();
+			message.body = std::move(data);
 			return message;
 		}
 
-		static Message<T> ConstructMessage(T protocal, const std::vector<byte>& data)
+		static Message<T> ConstructMessage(T protocal, body_type data)
 		{
 			Message<T> message;
 			message.header.protocal = protocal;
-			message.body = data;
 			message.header.size = data.size();
+			message.body = std::move(data);
 			return message;
 		}
 
+		// Same as above for a body held in a vector with another allocator, such as the
+		// std::vector<byte> bodies used before BufferPool. The bytes are copied into a pooled body.
+		template<typename Allocator>
+			requires (!std::is_same_v<Allocator, BufferAllocator<byte>>)
+		static Message<T> ConstructMessage(T protocal, size_t from, size_t dest, const std::vector<byte, Allocator>& data)
+		{
+			return ConstructMessage(protocal, from, dest, body_type(data.begin(), data.end()));
+		}
+
+		template<typename Allocator>
+			requires (!std::is_same_v<Allocator, BufferAllocator<byte>>)
+		static Message<T> ConstructMessage(T protocal, const std::vector<byte, Allocator>& data)
+		{
+			return ConstructMessage(protocal, body_type(data.begin(), data.end()));
+		}
+
 		// Returns the size of data in bytes
-		size_t size_in_bytes()
+		size_t size_in_bytes() const
 		{
 			return body.size() * sizeof(byte);
 		};
 
+		// Returns the number of body bytes not read by operator>> yet.
+		size_t remaining() const
+		{
+			return size_in_bytes() - cursor;
+		}
+
 		// Functions for user to write data in a easier way with operator<<, size of header will be re-calculated.
-		Message<T>& operator<<(std::vector<byte> datas)
+		Message<T>& operator<<(body_type datas)
 		{
-			body = datas;
+			body = std::move(datas);
 			header.size = body.size();
 			return *this;
 		}
 
-		// Same as above, push append one data into body everytime.
-		Message<T>& operator<<(byte data)
+		// Same as above, copies a body held in a vector with another allocator into a pooled body.
+		template<typename Allocator>
+			requires (!std::is_same_v<Allocator, BufferAllocator<byte>>)
+		Message<T>& operator<<(const std::vector<byte, Allocator>& datas)
 		{
-			body.push_back(data);
-			header.size = body.size();
+			return *this << body_type(datas.begin(), datas.end());
+		}
+
+		// Same as above, appends the bytes of a trivially copyable value (integer, float, enum or
+		// POD struct) to the body in host byte order.
+		template<typename V>
+			requires std::is_trivially_copyable_v<V> && (!std::is_pointer_v<V>) && (!std::is_array_v<V>)
+		Message<T>& operator<<(const V& data)
+		{
+			std::memcpy(append(sizeof(V)), &data, sizeof(V));
+			return *this;
+		}
+
+		// Appends a string as a 32-bit length followed by its characters.
+		Message<T>& operator<<(std::string_view data)
+		{
+			*this << static_cast<uint32_t>(data.size());
+			std::memcpy(append(data.size()), data.data(), data.size());
+			return *this;
+		}
+
+		// Reads the next value written by operator<< from the body, in the order they were written.
+		// Throws std::out_of_range if the body does not hold enough bytes.
+		template<typename V>
+			requires std::is_trivially_copyable_v<V> && (!std::is_pointer_v<V>) && (!std::is_array_v<V>)
+		Message<T>& operator>>(V& data)
+		{
+			std::memcpy(&data, consume(sizeof(V)), sizeof(V));
+			return *this;
+		}
+
+		Message<T>& operator>>(std::string& data)
+		{
+			uint32_t size = 0;
+			*this >> size;
+			const uint8_t* chars = consume(size);
+			data.assign(reinterpret_cast<const char*>(chars), size);
 			return *this;
 		}
 
@@ -79,96 +165,242 @@ namespace net
 
 			return json;
 		}
+
+	private:
+		// Grows the body by enough elements to hold size bytes and returns where they start.
+		uint8_t* append(size_t size)
+		{
+			size_t offset = size_in_bytes();
+			body.resize(body.size() + (size + sizeof(byte) - 1) / sizeof(byte));
+			header.size = body.size();
+			return reinterpret_cast<uint8_t*>(body.data()) + offset;
+		}
+
+		// Returns where the next size bytes are and moves the cursor past them, padded to whole elements.
+		const uint8_t* consume(size_t size)
+		{
+			if (size > remaining())
+				throw std::out_of_range("Message: read past the end of the body");
+			const uint8_t* data = reinterpret_cast<const uint8_t*>(body.data()) + cursor;
+			cursor = std::min(cursor + (size + sizeof(byte) - 1) / sizeof(byte) * sizeof(byte), size_in_bytes());
+			return data;
+		}
 	};
 
-	// A thread-safe queue that has two queues for storing messages sent from and to server.
-	// It use a scoped lock to lock current thread to prevents race condition.
-	template<Protocal T>
-	class MessageQueue
+	// A queue guarded by one mutex, every operation takes the lock. It is the default storage
+	// of MessageQueue, MpscQueue is the lock-free alternative with the same interface.
+	template<typename M>
+	class LockedQueue
 	{
 	public:
-		// Gets the first received message in the queue.
-		Message<T> ReadMessageIn();
-		// Adds a new received message into the queue.
-		void WriteMessageIn(const Message<T>& message);
-		// Gets the next message that will be sent in the queue.
-		Message<T> ReadMessageOut();
-		// Adds a new message that will be sent into the queue.
-		void WriteMessageOut(const Message<T>& message);
-		// Removes the first received message in the queue.
-		void PopMessageIn();
-		// Removes the first sent message in the queue.
-		void PopMessageOut();
-		// Returns true if the received message queue is empty, otherwise false.
-		bool MessageInEmpty();
-		// Returns true if the sent message queue is empty, otherwise false.
-		bool MessageOutEmpty();
+		void Push(const M& value);
+		void Push(M&& value);
+		M Front();
+		bool TryPop(M& value);
+		void Pop();
+		bool Empty();
 	private:
-		std::queue<Message<T>> m_messages_in;
-		std::queue<Message<T>> m_messages_out;
+		std::queue<M> m_queue;
 		std::mutex m_mutex;
 	};
 
-	template<Protocal T>
-	Message<T> MessageQueue<T>::ReadMessageIn()
+	template<typename M>
+	void LockedQueue<M>::Push(const M& value)
 	{
 		std::scoped_lock lock(m_mutex);
-		return m_messages_in.front();
+		m_queue.push(value);
 	}
 
-	template<Protocal T>
-	void MessageQueue<T>::WriteMessageIn(const Message<T>& message)
+	template<typename M>
+	void LockedQueue<M>::Push(M&& value)
 	{
 		std::scoped_lock lock(m_mutex);
-		m_messages_in.push(message);
+		m_queue.push(std::move(value));
 	}
 
-	template<Protocal T>
-	Message<T> MessageQueue<T>::ReadMessageOut()
+	template<typename M>
+	M LockedQueue<M>::Front()
 	{
 		std::scoped_lock lock(m_mutex);
-		return m_messages_out.front();
+		return m_queue.front();
 	}
 
-	template<Protocal T>
-	void MessageQueue<T>::WriteMessageOut(const Message<T>& message)
+	template<typename M>
+	bool LockedQueue<M>::TryPop(M& value)
 	{
 		std::scoped_lock lock(m_mutex);
-		m_messages_out.push(message);
+		if (m_queue.empty())
+			return false;
+		value = std::move(m_queue.front());
+		m_queue.pop();
+		return true;
 	}
 
-	template<Protocal T>
-	void MessageQueue<T>::PopMessageIn()
+	template<typename M>
+	void LockedQueue<M>::Pop()
 	{
 		std::scoped_lock lock(m_mutex);
-		if (m_messages_in.empty())
+		if (m_queue.empty())
 			return;
-		m_messages_in.pop();
-	}	
-	
-	template<Protocal T>
-	void MessageQueue<T>::PopMessageOut()
+		m_queue.pop();
+	}
+
+	template<typename M>
+	bool LockedQueue<M>::Empty()
 	{
 		std::scoped_lock lock(m_mutex);
-		if (m_messages_out.empty())
-			return;
-		m_messages_out.pop();
+		return m_queue.empty();
 	}
 
-	template<Protocal T>
-	bool MessageQueue<T>::MessageInEmpty()
+	// A thread-safe queue storing the messages received by one or more connections, until the
+	// application handles them. Messages to be sent are queued by each Connection separately.
+	// Storage selects the underlying queue: LockedQueue (default) allows any thread to consume,
+	// MpscQueue is lock-free but only one thread may read, pop or check for emptiness.
+	// A consumer can block in WaitMessageIn() or PopMessageIn(message) instead of polling: it spins
+	// briefly on a counter of written messages, then parks on a condition variable that producers
+	// only signal while someone waits.
+	template<Protocal T, template<typename> class Storage = LockedQueue>
+	class MessageQueue
 	{
-		std::scoped_lock lock(m_mutex);
-		return m_messages_in.empty();
+	public:
+		MessageQueue();
+		// Gets a copy of the first received message in the queue.
+		Message<T> ReadMessageIn();
+		// Adds a new received message into the queue.
+		void WriteMessageIn(const Message<T>& message);
+		// Same as above, but takes over the body of message instead of copying it.
+		void WriteMessageIn(Message<T>&& message);
+		// Moves the first received message into message and removes it from the queue.
+		// Returns false if the queue is empty. Prefer this to ReadMessageIn() and PopMessageIn().
+		bool TryPopMessageIn(Message<T>& message);
+		// Removes the first received message in the queue.
+		void PopMessageIn();
+		// Moves the first received message into message and removes it from the queue, waiting
+		// for a message to arrive if the queue is empty.
+		void PopMessageIn(Message<T>& message);
+		// Waits until the queue is not empty or timeout has passed. Returns true if the queue is not empty.
+		bool WaitMessageIn(std::chrono::nanoseconds timeout);
+		// Returns true if the received message queue is empty, otherwise false.
+		bool MessageInEmpty();
+	private:
+		// Wakes a consumer parked in WaitMessageIn(), if there is any.
+		void NotifyMessageIn();
+	private:
+		// Upper bound of the spin before parking. The current bound grows while spinning finds
+		// messages and shrinks while it does not, so an idle consumer parks almost immediately.
+		static constexpr uint32_t MaxSpin = 4096;
+		static constexpr uint32_t MinSpin = 16;
+		Storage<Message<T>> m_messages_in;
+		std::atomic<uint32_t> m_spin;
+		// Messages written so far, so a spinning consumer sees new ones without touching the storage.
+		std::atomic<uint64_t> m_written;
+		std::atomic<uint32_t> m_waiters;
+		std::mutex m_wait_mutex;
+		std::condition_variable m_wait_condition;
+	};
+
+	template<Protocal T, template<typename> class Storage>
+	MessageQueue<T, Storage>::MessageQueue() : m_messages_in(), m_spin(MinSpin), m_written(0), m_waiters(0)
+	{
+
 	}
 
-	template<Protocal T>
-	bool MessageQueue<T>::MessageOutEmpty()
+	template<Protocal T, template<typename> class Storage>
+	Message<T> MessageQueue<T, Storage>::ReadMessageIn()
 	{
-		std::scoped_lock lock(m_mutex);
-		return m_messages_out.empty();
+		return m_messages_in.Front();
 	}
-}
 
+	template<Protocal T, template<typename> class Storage>
+	void MessageQueue<T, Storage>::WriteMessageIn(const Message<T>& message)
+	{
+		WriteMessageIn(Message<T>(message));
+	}
+
+	template<Protocal T, template<typename> class Storage>
+	void MessageQueue<T, Storage>::WriteMessageIn(Message<T>&& message)
+	{
+		probe::Record(probe::Stage::Parse, message.timestamp);
+		m_messages_in.Push(std::move(message));
+		m_written.fetch_add(1, std::memory_order_release);
+		NotifyMessageIn();
+	}
 
+	template<Protocal T, template<typename> class Storage>
+	bool MessageQueue<T, Storage>::TryPopMessageIn(Message<T>& message)
+	{
+		if (!m_messages_in.TryPop(message))
+			return false;
+		probe::Record(probe::Stage::Queue, message.timestamp);
+		return true;
+	}
 
+	template<Protocal T, template<typename> class Storage>
+	void MessageQueue<T, Storage>::PopMessageIn()
+	{
+		m_messages_in.Pop();
+	}
+
+	template<Protocal T, template<typename> class Storage>
+	void MessageQueue<T, Storage>::PopMessageIn(Message<T>& message)
+	{
+		while (!TryPopMessageIn(message))
+		{
+			WaitMessageIn(std::chrono::seconds(1));
+		}
+	}
+
+	template<Protocal T, template<typename> class Storage>
+	bool MessageQueue<T, Storage>::WaitMessageIn(std::chrono::nanoseconds timeout)
+	{
+		// A message written after written was read bumps the counter, one written before is seen
+		// by the check of the storage, which takes the LockedQueue mutex only once.
+		uint64_t written = m_written.load(std::memory_order_acquire);
+		if (!m_messages_in.Empty())
+			return true;
+		uint32_t spin = m_spin.load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < spin; ++i)
+		{
+			if (m_written.load(std::memory_order_acquire) != written)
+			{
+				m_spin.store(std::min(spin * 2, MaxSpin), std::memory_order_relaxed);
+				return true;
+			}
+			CpuRelax();
+		}
+		m_spin.store(std::max(spin / 2, MinSpin), std::memory_order_relaxed);
+
+		// Register as a waiter before the last check, so a producer that pushes after the check
+		// sees the waiter and signals. The fence here and the one in NotifyMessageIn() keep the
+		// store to m_waiters from passing the check of the storage, and the push from passing the
+		// load of m_waiters, which acquire and release accesses alone do not prevent.
+		m_waiters.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool ready;
+		{
+			std::unique_lock lock(m_wait_mutex);
+			ready = m_wait_condition.wait_for(lock, timeout, [this]() { return !m_messages_in.Empty(); });
+		}
+		m_waiters.fetch_sub(1, std::memory_order_relaxed);
+		return ready;
+	}
+
+	template<Protocal T, template<typename> class Storage>
+	bool MessageQueue<T, Storage>::MessageInEmpty()
+	{
+		return m_messages_in.Empty();
+	}
+
+	template<Protocal T, template<typename> class Storage>
+	void MessageQueue<T, Storage>::NotifyMessageIn()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_waiters.load(std::memory_order_seq_cst) == 0)
+			return;
+		// Taking the mutex ensures the waiter is either before its check or already waiting.
+		{
+			std::scoped_lock lock(m_wait_mutex);
+		}
+		m_wait_condition.notify_one();
+	}
+}
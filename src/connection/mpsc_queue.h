@@ -0,0 +1,122 @@
+#pragma once
+#include <atomic>
+#include <new>
+#include <utility>
+#include "core.hpp"
+
+namespace net
+{
+	// A lock-free unbounded multi-producer single-consumer queue (Vyukov's intrusive MPSC design).
+	// Any number of threads may call Push() concurrently; a push is one atomic exchange and never
+	// waits. Front(), TryPop() and Empty() must only be called by the single consumer thread.
+	// A push that is still in progress may briefly not be visible to the consumer yet, in which
+	// case the queue looks empty and the message shows up on a later call.
+	template<typename M>
+	class MpscQueue
+	{
+	public:
+		MpscQueue();
+		~MpscQueue();
+		MpscQueue(const MpscQueue&) = delete;
+		MpscQueue& operator=(const MpscQueue&) = delete;
+		// Adds a value to the back of the queue, may be called from any thread.
+		void Push(const M& value);
+		void Push(M&& value);
+		// Returns the value at the front of the queue, the queue must not be empty.
+		M& Front();
+		// Moves the value at the front of the queue into value and removes it.
+		// Returns false if the queue is empty.
+		bool TryPop(M& value);
+		// Removes the value at the front of the queue if there is one.
+		void Pop();
+		bool Empty() const;
+	private:
+		struct Node
+		{
+			std::atomic<Node*> next{ nullptr };
+			M value;
+		};
+
+		void PushNode(Node* node);
+	private:
+		// Producers and the consumer work on opposite ends, keep them on separate cache lines.
+		alignas(64) std::atomic<Node*> m_head;
+		alignas(64) Node* m_tail;
+	};
+
+	template<typename M>
+	MpscQueue<M>::MpscQueue() : m_head(new Node()), m_tail(m_head.load(std::memory_order_relaxed))
+	{
+
+	}
+
+	template<typename M>
+	MpscQueue<M>::~MpscQueue()
+	{
+		while (m_tail != nullptr)
+		{
+			Node* next = m_tail->next.load(std::memory_order_relaxed);
+			delete m_tail;
+			m_tail = next;
+		}
+	}
+
+	template<typename M>
+	void MpscQueue<M>::Push(const M& value)
+	{
+		Node* node = new Node();
+		node->value = value;
+		PushNode(node);
+	}
+
+	template<typename M>
+	void MpscQueue<M>::Push(M&& value)
+	{
+		Node* node = new Node();
+		node->value = std::move(value);
+		PushNode(node);
+	}
+
+	template<typename M>
+	void MpscQueue<M>::PushNode(Node* node)
+	{
+		Node* previous = m_head.exchange(node, std::memory_order_acq_rel);
+		previous->next.store(node, std::memory_order_release);
+	}
+
+	template<typename M>
+	M& MpscQueue<M>::Front()
+	{
+		return m_tail->next.load(std::memory_order_acquire)->value;
+	}
+
+	template<typename M>
+	bool MpscQueue<M>::TryPop(M& value)
+	{
+		Node* next = m_tail->next.load(std::memory_order_acquire);
+		if (next == nullptr)
+			return false;
+		// The popped node becomes the new stub, its value is left moved-from.
+		value = std::move(next->value);
+		delete m_tail;
+		m_tail = next;
+		return true;
+	}
+
+	template<typename M>
+	void MpscQueue<M>::Pop()
+	{
+		Node* next = m_tail->next.load(std::memory_order_acquire);
+		if (next == nullptr)
+			return;
+		next->value = M();
+		delete m_tail;
+		m_tail = next;
+	}
+
+	template<typename M>
+	bool MpscQueue<M>::Empty() const
+	{
+		return m_tail->next.load(std::memory_order_acquire) == nullptr;
+	}
+}
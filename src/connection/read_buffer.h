@@ -0,0 +1,152 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "core.hpp"
+#include "message_queue.h"
+#include "wire_format.h"
+
+namespace net
+{
+	// A fixed-capacity receive buffer owned by a connection. Socket reads append bytes at the
+	// tail and the frame parser consumes complete frames from the head. Before the next read,
+	// the unparsed remainder (at most one partial frame) is moved back to the front, so a frame
+	// is always contiguous in memory and can be parsed in place.
+	class ReadBuffer
+	{
+	public:
+		explicit ReadBuffer(size_t capacity);
+		// Returns the free space after the unparsed bytes, for the next socket read.
+		asio::mutable_buffer Prepare();
+		// Marks size bytes written into the buffer returned by Prepare() as readable.
+		void Commit(size_t size);
+		// Removes size bytes from the front of the readable bytes.
+		void Consume(size_t size);
+		const uint8_t* Data() const;
+		// Returns the number of readable bytes.
+		size_t Size() const;
+		size_t Capacity() const;
+	private:
+		std::vector<uint8_t> m_buffer;
+		size_t m_head;
+		size_t m_tail;
+	};
+
+	// What the front of a ReadBuffer holds, see PeekFrame().
+	enum class FrameStatus
+	{
+		// A whole frame.
+		Complete,
+		// Part of a frame that fits the buffer, more bytes have to be read.
+		Incomplete,
+		// The start of a frame larger than the buffer, the rest of its body has to be read separately.
+		Oversized,
+		// Bytes that are not a valid frame.
+		Malformed
+	};
+
+	// The header of the frame at the front of a ReadBuffer and its sizes.
+	template<Protocal T>
+	struct FrameInfo
+	{
+		Header<T> header;
+		size_t header_bytes = 0;
+		size_t body_bytes = 0;
+
+		size_t FrameBytes() const
+		{
+			return header_bytes + body_bytes;
+		}
+	};
+
+	// Decodes the header of the frame at the front of buffer into frame. A frame whose body is
+	// larger than max_body_bytes is malformed. The connection types parse their input with this
+	// and TakeFrame(), so they agree on what a valid frame is.
+	template<Protocal T>
+	FrameStatus PeekFrame(const ReadBuffer& buffer, FrameInfo<T>& frame, size_t max_body_bytes = wire::DefaultMaxBodyBytes);
+
+	// Starts message with the frame PeekFrame() found at the front of buffer. Copies its header and
+	// as much of its body as buffer holds and consumes those bytes. Returns the body bytes copied,
+	// all of them unless the frame is oversized.
+	template<Protocal T>
+	size_t TakeFrame(ReadBuffer& buffer, const FrameInfo<T>& frame, Message<T>& message);
+
+	inline ReadBuffer::ReadBuffer(size_t capacity) : m_buffer(capacity), m_head(0), m_tail(0)
+	{
+
+	}
+
+	inline asio::mutable_buffer ReadBuffer::Prepare()
+	{
+		if (m_head > 0)
+		{
+			std::memmove(m_buffer.data(), m_buffer.data() + m_head, m_tail - m_head);
+			m_tail -= m_head;
+			m_head = 0;
+		}
+		return asio::buffer(m_buffer.data() + m_tail, m_buffer.size() - m_tail);
+	}
+
+	inline void ReadBuffer::Commit(size_t size)
+	{
+		m_tail += size;
+	}
+
+	inline void ReadBuffer::Consume(size_t size)
+	{
+		m_head += size;
+		if (m_head == m_tail)
+		{
+			m_head = 0;
+			m_tail = 0;
+		}
+	}
+
+	inline const uint8_t* ReadBuffer::Data() const
+	{
+		return m_buffer.data() + m_head;
+	}
+
+	inline size_t ReadBuffer::Size() const
+	{
+		return m_tail - m_head;
+	}
+
+	inline size_t ReadBuffer::Capacity() const
+	{
+		return m_buffer.size();
+	}
+
+	template<Protocal T>
+	FrameStatus PeekFrame(const ReadBuffer& buffer, FrameInfo<T>& frame, size_t max_body_bytes)
+	{
+		wire::DecodeResult result = wire::DecodeHeader(buffer.Data(), buffer.Size(), frame.header, frame.header_bytes, max_body_bytes);
+		if (result == wire::DecodeResult::Incomplete)
+			return FrameStatus::Incomplete;
+		if (result == wire::DecodeResult::Malformed)
+			return FrameStatus::Malformed;
+
+		// DecodeHeader() bounded the body by max_body_bytes, so only the sum can still overflow.
+		frame.body_bytes = frame.header.size * sizeof(typename Message<T>::byte);
+		if (frame.body_bytes > SIZE_MAX - frame.header_bytes)
+			return FrameStatus::Malformed;
+		if (buffer.Size() >= frame.FrameBytes())
+			return FrameStatus::Complete;
+		if (frame.FrameBytes() > buffer.Capacity())
+			return FrameStatus::Oversized;
+		return FrameStatus::Incomplete;
+	}
+
+	template<Protocal T>
+	size_t TakeFrame(ReadBuffer& buffer, const FrameInfo<T>& frame, Message<T>& message)
+	{
+		message.header = frame.header;
+		message.body.resize(frame.header.size);
+		size_t buffered = std::min(frame.body_bytes, buffer.Size() - frame.header_bytes);
+		if (buffered != 0)
+			std::memcpy(message.body.data(), buffer.Data() + frame.header_bytes, buffered);
+		buffer.Consume(frame.header_bytes + buffered);
+		return buffered;
+	}
+}
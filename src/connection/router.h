@@ -0,0 +1,81 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "core.hpp"
+
+namespace net
+{
+	template<Protocal T, typename Queue>
+	class Connection;
+
+	// Maps connection ids to connections, so a connection can forward a frame whose header.dest
+	// names another connection straight to it on its own I/O thread, without the message queue.
+	// The table is copy-on-write: Add() and Remove() publish a new copy, readers take a snapshot
+	// with GetTable() and look ids up in it without any lock. A connection given the router with
+	// Connection::SetRouter() removes itself when it is closed. Connections are held weakly, so
+	// the ids of connections destroyed without being closed stop resolving too, and are pruned by
+	// the next Add().
+	template<Protocal T, typename Queue>
+	class Router
+	{
+	public:
+		using ConnectionPtr = std::shared_ptr<Connection<T, Queue>>;
+		using Table = std::unordered_map<size_t, std::weak_ptr<Connection<T, Queue>>>;
+
+		Router();
+		// Make connection reachable by its id.
+		void Add(const ConnectionPtr& connection);
+		// Make the connection with id unreachable, does nothing if there is none.
+		void Remove(size_t id);
+		// Returns the current table, it stays unchanged while it is held.
+		std::shared_ptr<const Table> GetTable() const;
+		// Returns the connection with id in table, or nullptr if there is none.
+		static ConnectionPtr Find(const Table& table, size_t id);
+	private:
+		std::mutex m_update_mutex;
+		std::atomic<std::shared_ptr<const Table>> m_table;
+	};
+
+	template<Protocal T, typename Queue>
+	Router<T, Queue>::Router() : m_update_mutex(), m_table(std::make_shared<const Table>())
+	{
+
+	}
+
+	template<Protocal T, typename Queue>
+	void Router<T, Queue>::Add(const ConnectionPtr& connection)
+	{
+		std::scoped_lock lock(m_update_mutex);
+		auto table = std::make_shared<Table>(*m_table.load(std::memory_order_acquire));
+		std::erase_if(*table, [](const auto& entry) { return entry.second.expired(); });
+		(*table)[connection->GetId()] = connection;
+		m_table.store(std::move(table), std::memory_order_release);
+	}
+
+	template<Protocal T, typename Queue>
+	void Router<T, Queue>::Remove(size_t id)
+	{
+		std::scoped_lock lock(m_update_mutex);
+		std::shared_ptr<const Table> current = m_table.load(std::memory_order_acquire);
+		if (!current->contains(id))
+			return;
+		auto table = std::make_shared<Table>(*current);
+		table->erase(id);
+		m_table.store(std::move(table), std::memory_order_release);
+	}
+
+	template<Protocal T, typename Queue>
+	std::shared_ptr<const typename Router<T, Queue>::Table> Router<T, Queue>::GetTable() const
+	{
+		return m_table.load(std::memory_order_acquire);
+	}
+
+	template<Protocal T, typename Queue>
+	typename Router<T, Queue>::ConnectionPtr Router<T, Queue>::Find(const Table& table, size_t id)
+	{
+		auto it = table.find(id);
+		return it == table.end() ? nullptr : it->second.lock();
+	}
+}
@@ -0,0 +1,167 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+#include "core.hpp"
+#include "message_queue.h"
+#include "wire_format.h"
+
+namespace net
+{
+	// A message with its header already encoded, shared by every connection that sends it. It is
+	// immutable once created, so any number of connections on any threads can write it at the same
+	// time, each only holding a reference instead of a copy of the body.
+	template<Protocal T>
+	class SharedFrame
+	{
+	public:
+		// Encodes message once. The second overload takes over the body instead of copying it.
+		static std::shared_ptr<const SharedFrame> Encode(const Message<T>& message);
+		static std::shared_ptr<const SharedFrame> Encode(Message<T>&& message);
+
+		const Message<T>& GetMessage() const;
+		// Returns the bytes of the frame on the wire, header and body.
+		size_t Size() const;
+		// Appends the buffers of the frame, header and body if it is not empty, to buffers.
+		template<typename Buffers>
+		void AppendBuffers(Buffers& buffers) const;
+
+		explicit SharedFrame(Message<T>&& message);
+	private:
+		Message<T> m_message;
+		std::array<uint8_t, wire::MaxHeaderSize<T>> m_header;
+		size_t m_header_size;
+	};
+
+	template<Protocal T>
+	using SharedFramePtr = std::shared_ptr<const SharedFrame<T>>;
+
+	// An entry of a connection's outgoing queue, a message of its own, a reference to a shared
+	// frame, or a frame forwarded from another connection. With a shared frame, message is empty
+	// and only carries the latency probe timestamp. A forwarded frame has a non-zero encoded_size
+	// and the first encoded_size bytes of message.body are the whole frame, header included.
+	template<Protocal T>
+	struct OutgoingFrame
+	{
+		Message<T> message;
+		SharedFramePtr<T> shared;
+		size_t encoded_size = 0;
+
+		// Returns the bytes of the frame on the wire.
+		size_t Size() const
+		{
+			if (encoded_size != 0)
+				return encoded_size;
+			return shared ? shared->Size() : wire::EncodedHeaderSize(message.header) + message.size_in_bytes();
+		}
+	};
+
+	// Limits of a single gathered write. At least one message is always sent, even if it
+	// alone exceeds max_bytes. A non-zero flush_delay holds back the first write of a burst
+	// for that long so that messages queued shortly after can join the same batch, trading
+	// latency for throughput like Nagle's algorithm. Zero sends as soon as possible.
+	// This replaces kernel Nagle: TcpServer and TcpClient set TCP_NODELAY on their sockets, so
+	// a batch goes out when it is written instead of waiting for the peer's delayed ACK.
+	struct WriteBatchOptions
+	{
+		size_t max_messages = 256;
+		size_t max_bytes = 256 * 1024;
+		std::chrono::microseconds flush_delay{ 0 };
+	};
+
+	// Moves frames from the front of queue to the back of batch until the limits of options are
+	// reached, at least one if queue is not empty. Returns the number of frames moved.
+	template<Protocal T>
+	size_t TakeFrames(std::deque<OutgoingFrame<T>>& queue, std::vector<OutgoingFrame<T>>& batch, const WriteBatchOptions& options);
+
+	// Appends the buffers of every frame in batch to buffers, header and body of each frame back
+	// to back, ready for one gathered write. Headers not encoded yet are written to headers, which
+	// must stay unchanged until the write completes.
+	template<Protocal T>
+	void GatherFrames(const std::vector<OutgoingFrame<T>>& batch, std::vector<uint8_t>& headers, std::vector<asio::const_buffer>& buffers);
+
+	template<Protocal T>
+	SharedFrame<T>::SharedFrame(Message<T>&& message) : m_message(std::move(message)), m_header(), m_header_size(0)
+	{
+		m_header_size = wire::EncodeHeader(m_message.header, m_header.data());
+	}
+
+	template<Protocal T>
+	std::shared_ptr<const SharedFrame<T>> SharedFrame<T>::Encode(const Message<T>& message)
+	{
+		return Encode(Message<T>(message));
+	}
+
+	template<Protocal T>
+	std::shared_ptr<const SharedFrame<T>> SharedFrame<T>::Encode(Message<T>&& message)
+	{
+		return std::make_shared<const SharedFrame<T>>(std::move(message));
+	}
+
+	template<Protocal T>
+	const Message<T>& SharedFrame<T>::GetMessage() const
+	{
+		return m_message;
+	}
+
+	template<Protocal T>
+	size_t SharedFrame<T>::Size() const
+	{
+		return m_header_size + m_message.size_in_bytes();
+	}
+
+	template<Protocal T>
+	template<typename Buffers>
+	void SharedFrame<T>::AppendBuffers(Buffers& buffers) const
+	{
+		buffers.push_back(asio::buffer(m_header.data(), m_header_size));
+		if (!m_message.body.empty())
+			buffers.push_back(asio::buffer(m_message.body.data(), m_message.size_in_bytes()));
+	}
+
+	template<Protocal T>
+	size_t TakeFrames(std::deque<OutgoingFrame<T>>& queue, std::vector<OutgoingFrame<T>>& batch, const WriteBatchOptions& options)
+	{
+		size_t count = 0;
+		size_t bytes = 0;
+		while (!queue.empty() && count < options.max_messages)
+		{
+			size_t frame_bytes = queue.front().Size();
+			if (count > 0 && bytes + frame_bytes > options.max_bytes)
+				break;
+			batch.push_back(std::move(queue.front()));
+			queue.pop_front();
+			bytes += frame_bytes;
+			count += 1;
+		}
+		return count;
+	}
+
+	template<Protocal T>
+	void GatherFrames(const std::vector<OutgoingFrame<T>>& batch, std::vector<uint8_t>& headers, std::vector<asio::const_buffer>& buffers)
+	{
+		headers.resize(batch.size() * wire::MaxHeaderSize<T>);
+		uint8_t* header = headers.data();
+		for (const OutgoingFrame<T>& frame : batch)
+		{
+			if (frame.shared)
+			{
+				frame.shared->AppendBuffers(buffers);
+				continue;
+			}
+			if (frame.encoded_size != 0)
+			{
+				buffers.push_back(asio::buffer(frame.message.body.data(), frame.encoded_size));
+				continue;
+			}
+			const Message<T>& message = frame.message;
+			buffers.push_back(asio::buffer(header, wire::EncodeHeader(message.header, header)));
+			header += wire::MaxHeaderSize<T>;
+			if (!message.body.empty())
+				buffers.push_back(asio::buffer(message.body.data(), message.size_in_bytes()));
+		}
+	}
+}
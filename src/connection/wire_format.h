@@ -0,0 +1,205 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include "core.hpp"
+#include "message_queue.h"
+
+namespace net
+{
+	// Encoding of Header<T> on the wire:
+	//   size, from, dest  unsigned LEB128 varints (7 bits per byte, least significant group first)
+	//   protocal          if T is an enum or an integer, its value as a varint (zigzag encoded when
+	//                     it is signed), otherwise the sizeof(T) raw bytes of T
+	// Headers of enum and integer protocals are independent of the host's endianness and padding.
+	// A struct protocal is sent in the host's layout, so both peers must agree on it.
+	// A message with a small body and zero ids costs 4 bytes of header instead of sizeof(Header<T>).
+	namespace wire
+	{
+		// Maximum bytes of a varint encoding a 64-bit value.
+		constexpr size_t MaxVarintSize = 10;
+		// Bodies larger than this are rejected by DecodeHeader() unless it is given another limit.
+		constexpr size_t DefaultMaxBodyBytes = 64 * 1024 * 1024;
+
+		enum class DecodeResult
+		{
+			Ok,
+			// More bytes are needed to decode the header.
+			Incomplete,
+			// The bytes are not a valid header.
+			Malformed
+		};
+
+		// True if the protocal is sent as a varint rather than as raw bytes.
+		template<Protocal T>
+		constexpr bool IsVarintProtocal = std::is_enum_v<T> || std::is_integral_v<T>;
+
+		template<Protocal T>
+		constexpr size_t ProtocalSize()
+		{
+			if constexpr (IsVarintProtocal<T>)
+				return MaxVarintSize;
+			else
+				return sizeof(T);
+		}
+
+		// Upper bound of the encoded size of a Header<T>.
+		template<Protocal T>
+		constexpr size_t MaxHeaderSize = 3 * MaxVarintSize + ProtocalSize<T>();
+
+		inline size_t VarintSize(uint64_t value)
+		{
+			size_t size = 1;
+			while (value >= 0x80)
+			{
+				value >>= 7;
+				size += 1;
+			}
+			return size;
+		}
+
+		inline size_t EncodeVarint(uint64_t value, uint8_t* out)
+		{
+			size_t size = 0;
+			while (value >= 0x80)
+			{
+				out[size++] = static_cast<uint8_t>(value) | 0x80;
+				value >>= 7;
+			}
+			out[size++] = static_cast<uint8_t>(value);
+			return size;
+		}
+
+		inline DecodeResult DecodeVarint(const uint8_t* data, size_t size, uint64_t& value, size_t& consumed)
+		{
+			value = 0;
+			for (size_t i = 0; i < MaxVarintSize; ++i)
+			{
+				if (i == size)
+					return DecodeResult::Incomplete;
+				uint64_t group = data[i] & 0x7F;
+				// The tenth byte may only carry the top bit of a 64-bit value.
+				if (i == MaxVarintSize - 1 && group > 1)
+					return DecodeResult::Malformed;
+				value |= group << (7 * i);
+				if ((data[i] & 0x80) == 0)
+				{
+					consumed = i + 1;
+					return DecodeResult::Ok;
+				}
+			}
+			return DecodeResult::Malformed;
+		}
+
+		// The integer type holding the value of protocal T, its underlying type if it is an enum.
+		template<Protocal T>
+		using ProtocalInteger = typename std::conditional_t<std::is_enum_v<T>, std::underlying_type<T>, std::type_identity<T>>::type;
+
+		template<Protocal T>
+		uint64_t ProtocalToVarint(T protocal)
+		{
+			using Underlying = ProtocalInteger<T>;
+			Underlying value = static_cast<Underlying>(protocal);
+			if constexpr (std::is_signed_v<Underlying>)
+			{
+				int64_t wide = value;
+				return (static_cast<uint64_t>(wide) << 1) ^ static_cast<uint64_t>(wide >> 63);
+			}
+			else
+			{
+				return static_cast<uint64_t>(value);
+			}
+		}
+
+		template<Protocal T>
+		T ProtocalFromVarint(uint64_t value)
+		{
+			using Underlying = ProtocalInteger<T>;
+			if constexpr (std::is_signed_v<Underlying>)
+				return static_cast<T>(static_cast<Underlying>(static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1)));
+			else
+				return static_cast<T>(static_cast<Underlying>(value));
+		}
+
+		// Returns the number of bytes EncodeHeader() writes for header.
+		template<Protocal T>
+		size_t EncodedHeaderSize(const Header<T>& header)
+		{
+			size_t size = VarintSize(header.size) + VarintSize(header.from) + VarintSize(header.dest);
+			if constexpr (IsVarintProtocal<T>)
+				return size + VarintSize(ProtocalToVarint(header.protocal));
+			else
+				return size + sizeof(T);
+		}
+
+		// Writes header to out, which must hold MaxHeaderSize<T> bytes. Returns the bytes written.
+		template<Protocal T>
+		size_t EncodeHeader(const Header<T>& header, uint8_t* out)
+		{
+			size_t size = EncodeVarint(header.size, out);
+			size += EncodeVarint(header.from, out + size);
+			size += EncodeVarint(header.dest, out + size);
+			if constexpr (IsVarintProtocal<T>)
+			{
+				size += EncodeVarint(ProtocalToVarint(header.protocal), out + size);
+			}
+			else
+			{
+				std::memcpy(out + size, &header.protocal, sizeof(T));
+				size += sizeof(T);
+			}
+			return size;
+		}
+
+		// Reads a header from the size bytes at data. On success, header_size is set to the number of
+		// bytes the header took. A header announcing a body of more than max_body_bytes, or a protocal
+		// value out of the range of T, is malformed.
+		template<Protocal T>
+		DecodeResult DecodeHeader(const uint8_t* data, size_t size, Header<T>& header, size_t& header_size,
+			size_t max_body_bytes = DefaultMaxBodyBytes)
+		{
+			uint64_t fields[3];
+			size_t offset = 0;
+			for (uint64_t& field : fields)
+			{
+				size_t consumed = 0;
+				DecodeResult result = DecodeVarint(data + offset, size - offset, field, consumed);
+				if (result != DecodeResult::Ok)
+					return result;
+				offset += consumed;
+			}
+
+			if constexpr (IsVarintProtocal<T>)
+			{
+				uint64_t protocal = 0;
+				size_t consumed = 0;
+				DecodeResult result = DecodeVarint(data + offset, size - offset, protocal, consumed);
+				if (result != DecodeResult::Ok)
+					return result;
+				header.protocal = ProtocalFromVarint<T>(protocal);
+				if (ProtocalToVarint(header.protocal) != protocal)
+					return DecodeResult::Malformed;
+				offset += consumed;
+			}
+			else
+			{
+				if (size - offset < sizeof(T))
+					return DecodeResult::Incomplete;
+				std::memcpy(&header.protocal, data + offset, sizeof(T));
+				offset += sizeof(T);
+			}
+
+			// Bounding the element count also keeps its size in bytes from overflowing.
+			if (fields[0] > max_body_bytes / sizeof(typename Message<T>::byte))
+				return DecodeResult::Malformed;
+			// Ids that do not fit a size_t, only possible on 32-bit hosts.
+			if (fields[1] > SIZE_MAX || fields[2] > SIZE_MAX)
+				return DecodeResult::Malformed;
+			header.size = static_cast<size_t>(fields[0]);
+			header.from = static_cast<size_t>(fields[1]);
+			header.dest = static_cast<size_t>(fields[2]);
+			header_size = offset;
+			return DecodeResult::Ok;
+		}
+	}
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <iostream>
 
 #include <type_traits>
@@ -14,5 +16,55 @@ namespace net
 #define _WIN32_WINNT 0x0A00
 #endif // _WIN32
 
+// Define NET_USE_IO_URING to run sockets and timers on io_uring instead of the epoll reactor.
+// Linux only, the program must be linked with liburing. Asio picks its backend at compile
+// time, so every translation unit of a program has to be built with the same setting.
+#if defined(NET_USE_IO_URING) && defined(__linux__)
+#define ASIO_HAS_IO_URING 1
+#define ASIO_DISABLE_EPOLL 1
+#endif // NET_USE_IO_URING
+
 #define ASIO_STANDALONE
-#include "asio.hpp"
\ No newline at end of file
+#include "asio.hpp"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace net
+{
+	// Name of the I/O backend the io_context runs on in this build.
+	constexpr const char* IoBackend()
+	{
+#if defined(ASIO_HAS_IOCP)
+		return "iocp";
+#elif defined(ASIO_HAS_IO_URING_AS_DEFAULT)
+		return "io_uring";
+#elif defined(ASIO_HAS_EPOLL)
+		return "epoll";
+#elif defined(ASIO_HAS_KQUEUE)
+		return "kqueue";
+#else
+		return "select";
+#endif
+	}
+
+	// Hints the processor that the calling thread is spinning on a condition.
+	inline void CpuRelax()
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		_mm_pause();
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		__builtin_ia32_pause();
+#elif defined(__GNUC__) && defined(__aarch64__)
+		asm volatile("yield");
+#endif
+	}
+
+	// Adds value to a counter that only the calling thread writes while any thread may read it.
+	// A relaxed load and store instead of a locked read-modify-write.
+	inline void AddSingleWriter(std::atomic<uint64_t>& counter, uint64_t value = 1)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "core.hpp"
+
+namespace net
+{
+	// A pool of io_contexts, each run by its own thread. Connections are assigned to the contexts
+	// round robin, so all handlers of one connection run on one thread and the load of many
+	// connections is spread over all threads without sharing a reactor between them.
+	class IoContextPool
+	{
+	public:
+		explicit IoContextPool(size_t size);
+		// Stops the contexts and joins their threads.
+		~IoContextPool();
+		IoContextPool(const IoContextPool&) = delete;
+		IoContextPool& operator=(const IoContextPool&) = delete;
+		// Start one thread running each io_context. The contexts keep running without pending work.
+		void Run();
+		// Stop every io_context and wait for the threads to finish.
+		void Stop();
+		// Returns the next io_context in round robin order.
+		asio::io_context& GetIoContext();
+		asio::io_context& GetIoContext(size_t index);
+		size_t Size() const;
+	private:
+		using WorkGuard = asio::executor_work_guard<asio::io_context::executor_type>;
+
+		std::vector<std::unique_ptr<asio::io_context>> m_io_contexts;
+		std::vector<WorkGuard> m_work_guards;
+		std::vector<std::thread> m_threads;
+		std::atomic<size_t> m_next;
+	};
+
+	inline IoContextPool::IoContextPool(size_t size) : m_next(0)
+	{
+		if (size == 0)
+			size = 1;
+		for (size_t i = 0; i < size; ++i)
+		{
+			// Each context is only run by one thread. The hint of 1 lets asio run handlers without
+			// waking other threads, but it keeps the internal locking: other threads post to the
+			// context and write to its sockets, which only ASIO_CONCURRENCY_HINT_UNSAFE would break.
+			m_io_contexts.push_back(std::make_unique<asio::io_context>(1));
+			m_work_guards.push_back(asio::make_work_guard(*m_io_contexts.back()));
+		}
+	}
+
+	inline IoContextPool::~IoContextPool()
+	{
+		Stop();
+	}
+
+	inline void IoContextPool::Run()
+	{
+		for (std::unique_ptr<asio::io_context>& io_context : m_io_contexts)
+		{
+			m_threads.emplace_back([&io_context]() { io_context->run(); });
+		}
+	}
+
+	inline void IoContextPool::Stop()
+	{
+		m_work_guards.clear();
+		for (std::unique_ptr<asio::io_context>& io_context : m_io_contexts)
+			io_context->stop();
+		for (std::thread& thread : m_threads)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+		m_threads.clear();
+	}
+
+	inline asio::io_context& IoContextPool::GetIoContext()
+	{
+		return *m_io_contexts[m_next.fetch_add(1, std::memory_order_relaxed) % m_io_contexts.size()];
+	}
+
+	inline asio::io_context& IoContextPool::GetIoContext(size_t index)
+	{
+		return *m_io_contexts[index % m_io_contexts.size()];
+	}
+
+	inline size_t IoContextPool::Size() const
+	{
+		return m_io_contexts.size();
+	}
+}
@@ -0,0 +1,411 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "core.hpp"
+#include "connection/connection.h"
+#include "connection/shared_frame.h"
+#include "tcp_server.h"
+
+namespace net
+{
+	// Maps topics to the connections subscribed to them. The table and every subscriber list are
+	// copy-on-write: Subscribe() and Unsubscribe() publish a new table under a mutex, Publish()
+	// loads a snapshot and sends to it without that mutex. The load itself goes through the short
+	// internal spinlock libstdc++ uses for std::atomic<std::shared_ptr>. Changing a subscription
+	// copies the table and the subscribers of one topic, so it costs more the more topics there
+	// are, publishing does not. Like in Router, connections are held weakly, so a subscription
+	// does not keep a closed connection alive. Subscribers that have closed are removed by the
+	// first Publish() to their topic that finds them, or by UnsubscribeAll().
+	template<Protocal T, typename Queue>
+	class TopicIndex
+	{
+	public:
+		using ConnectionPtr = std::shared_ptr<Connection<T, Queue>>;
+
+		struct Subscriber
+		{
+			size_t id;
+			std::weak_ptr<Connection<T, Queue>> connection;
+		};
+
+		using Subscribers = std::vector<Subscriber>;
+
+		TopicIndex();
+		// Returns false if connection was already subscribed to topic.
+		bool Subscribe(std::string_view topic, const ConnectionPtr& connection);
+		// Returns false if the connection with id was not subscribed to topic.
+		bool Unsubscribe(std::string_view topic, size_t id);
+		// Remove the connection with id from every topic, e.g. once it has closed.
+		void UnsubscribeAll(size_t id);
+		// Returns the current subscribers of topic, they stay unchanged while they are held.
+		std::shared_ptr<const Subscribers> GetSubscribers(std::string_view topic) const;
+		// Send a message to every open subscriber of topic. The frame is encoded once, and not at
+		// all if nobody subscribed to topic. Returns the number of connections it was queued on.
+		size_t Publish(std::string_view topic, const Message<T>& message);
+		size_t Publish(std::string_view topic, Message<T>&& message);
+		size_t Publish(std::string_view topic, SharedFramePtr<T> frame);
+	private:
+		struct TopicHash
+		{
+			using is_transparent = void;
+
+			size_t operator()(std::string_view topic) const
+			{
+				return std::hash<std::string_view>{}(topic);
+			}
+		};
+
+		using Table = std::unordered_map<std::string, std::shared_ptr<const Subscribers>, TopicHash, std::equal_to<>>;
+
+		// Replace the subscribers of topic by a copy changed by update, if it returns true. Topics
+		// left without subscribers are removed.
+		template<typename Update>
+		bool Modify(std::string_view topic, Update update);
+		// Remove the destroyed and closed subscribers of topic.
+		void Prune(std::string_view topic);
+		static bool IsClosed(const Subscriber& subscriber);
+
+		std::mutex m_update_mutex;
+		std::atomic<std::shared_ptr<const Table>> m_table;
+	};
+
+	// The protocal values of the messages a PubSubServer handles itself. The body of each of them
+	// starts with the topic, written with operator<<(std::string_view), see TopicMessage().
+	template<Protocal T>
+	struct PubSubProtocal
+	{
+		T subscribe;
+		T unsubscribe;
+		// Sent unchanged to every subscriber of the topic, header.from names the publisher.
+		T publish;
+	};
+
+	// Returns a message of protocal whose body starts with topic, for a PubSubServer. The payload
+	// of a publish message can be appended with operator<<.
+	template<Protocal T>
+	Message<T> TopicMessage(T protocal, std::string_view topic)
+	{
+		Message<T> message;
+		message.header.protocal = protocal;
+		message << topic;
+		return message;
+	}
+
+	// A TcpServer that lets clients subscribe to topics and publish to them. Subscribe, unsubscribe
+	// and publish messages are handled by HandleMessage(), or by HandleWorkerMessage() on the
+	// worker threads if options.worker_count is not 0, every other message is passed to
+	// HandleOtherMessage(). The server stamps header.from on every received message, so it knows
+	// who subscribed, and stores and starts reading every accepted connection. Closed connections
+	// are dropped from m_connections and passed to OnClientDisconnect(), which unsubscribes them
+	// from every topic, when the next client connects or, without workers, at most every
+	// PruneInterval while messages arrive.
+	template<Protocal T, typename Queue = MessageQueue<T>>
+	class PubSubServer : public TcpServer<T, Queue>
+	{
+	public:
+		explicit PubSubServer(PubSubProtocal<T> protocal, const TcpServerOptions& options = TcpServerOptions());
+		TopicIndex<T, Queue>& GetTopics();
+	protected:
+		using typename TcpServer<T, Queue>::ConnectionPtr;
+
+		void OnClientConnect(ConnectionPtr& new_connection) override;
+		// Called with m_connections_mutex held. Overrides have to call this one.
+		void OnClientDisconnect(ConnectionPtr connection) override;
+		void HandleMessage() override;
+		void HandleWorkerMessage(Message<T>& message) override;
+		// Called for every message that is not a subscribe, unsubscribe or publish, on a worker
+		// thread if options.worker_count is not 0.
+		virtual void HandleOtherMessage(Message<T>& message);
+	private:
+		static constexpr std::chrono::milliseconds PruneInterval{ 1000 };
+
+		static TcpServerOptions StampSender(TcpServerOptions options);
+		// Subscribe, unsubscribe or publish as message asks, or pass it to HandleOtherMessage().
+		void HandleTopicMessage(Message<T>& message);
+		// Remove the closed connections from m_connections, m_connections_mutex must be held.
+		void RemoveClosedConnections();
+		// Returns the stored connection with id, or nullptr.
+		ConnectionPtr FindConnection(size_t id);
+	private:
+		PubSubProtocal<T> m_protocal;
+		TopicIndex<T, Queue> m_topics;
+		std::chrono::steady_clock::time_point m_next_prune;
+	};
+
+	template<Protocal T, typename Queue>
+	TopicIndex<T, Queue>::TopicIndex() : m_update_mutex(), m_table(std::make_shared<const Table>())
+	{
+
+	}
+
+	template<Protocal T, typename Queue>
+	bool TopicIndex<T, Queue>::Subscribe(std::string_view topic, const ConnectionPtr& connection)
+	{
+		return Modify(topic, [&connection](Subscribers& subscribers)
+		{
+			size_t id = connection->GetId();
+			if (std::ranges::any_of(subscribers, [id](const Subscriber& subscriber) { return subscriber.id == id; }))
+				return false;
+			subscribers.push_back({ id, connection });
+			return true;
+		});
+	}
+
+	template<Protocal T, typename Queue>
+	bool TopicIndex<T, Queue>::Unsubscribe(std::string_view topic, size_t id)
+	{
+		return Modify(topic, [id](Subscribers& subscribers)
+		{
+			return std::erase_if(subscribers, [id](const Subscriber& subscriber) { return subscriber.id == id; }) != 0;
+		});
+	}
+
+	template<Protocal T, typename Queue>
+	void TopicIndex<T, Queue>::UnsubscribeAll(size_t id)
+	{
+		auto subscribed = [id](const Subscriber& subscriber) { return subscriber.id == id; };
+		std::scoped_lock lock(m_update_mutex);
+		std::shared_ptr<const Table> current = m_table.load(std::memory_order_acquire);
+		if (std::ranges::none_of(*current, [&subscribed](const auto& entry) { return std::ranges::any_of(*entry.second, subscribed); }))
+			return;
+		auto table = std::make_shared<Table>(*current);
+		for (auto it = table->begin(); it != table->end();)
+		{
+			if (std::ranges::none_of(*it->second, subscribed))
+			{
+				++it;
+				continue;
+			}
+			auto subscribers = std::make_shared<Subscribers>(*it->second);
+			std::erase_if(*subscribers, subscribed);
+			if (subscribers->empty())
+			{
+				it = table->erase(it);
+			}
+			else
+			{
+				it->second = std::move(subscribers);
+				++it;
+			}
+		}
+		m_table.store(std::move(table), std::memory_order_release);
+	}
+
+	template<Protocal T, typename Queue>
+	std::shared_ptr<const typename TopicIndex<T, Queue>::Subscribers> TopicIndex<T, Queue>::GetSubscribers(std::string_view topic) const
+	{
+		std::shared_ptr<const Table> table = m_table.load(std::memory_order_acquire);
+		auto it = table->find(topic);
+		return it == table->end() ? nullptr : it->second;
+	}
+
+	template<Protocal T, typename Queue>
+	size_t TopicIndex<T, Queue>::Publish(std::string_view topic, const Message<T>& message)
+	{
+		if (!GetSubscribers(topic))
+			return 0;
+		return Publish(topic, SharedFrame<T>::Encode(message));
+	}
+
+	template<Protocal T, typename Queue>
+	size_t TopicIndex<T, Queue>::Publish(std::string_view topic, Message<T>&& message)
+	{
+		if (!GetSubscribers(topic))
+			return 0;
+		return Publish(topic, SharedFrame<T>::Encode(std::move(message)));
+	}
+
+	template<Protocal T, typename Queue>
+	size_t TopicIndex<T, Queue>::Publish(std::string_view topic, SharedFramePtr<T> frame)
+	{
+		std::shared_ptr<const Subscribers> subscribers = GetSubscribers(topic);
+		if (!subscribers)
+			return 0;
+		size_t sent = 0;
+		bool closed = false;
+		for (const Subscriber& subscriber : *subscribers)
+		{
+			ConnectionPtr connection = subscriber.connection.lock();
+			if (connection && connection->IsOpen())
+			{
+				connection->WriteFrame(frame);
+				sent += 1;
+			}
+			else
+			{
+				closed = true;
+			}
+		}
+		if (closed)
+			Prune(topic);
+		return sent;
+	}
+
+	template<Protocal T, typename Queue>
+	template<typename Update>
+	bool TopicIndex<T, Queue>::Modify(std::string_view topic, Update update)
+	{
+		std::scoped_lock lock(m_update_mutex);
+		std::shared_ptr<const Table> current = m_table.load(std::memory_order_acquire);
+		auto it = current->find(topic);
+		auto subscribers = it == current->end() ? std::make_shared<Subscribers>() : std::make_shared<Subscribers>(*it->second);
+		if (!update(*subscribers))
+			return false;
+		auto table = std::make_shared<Table>(*current);
+		if (subscribers->empty())
+			table->erase(std::string(topic));
+		else
+			(*table)[std::string(topic)] = std::move(subscribers);
+		m_table.store(std::move(table), std::memory_order_release);
+		return true;
+	}
+
+	template<Protocal T, typename Queue>
+	void TopicIndex<T, Queue>::Prune(std::string_view topic)
+	{
+		Modify(topic, [](Subscribers& subscribers)
+		{
+			return std::erase_if(subscribers, IsClosed) != 0;
+		});
+	}
+
+	template<Protocal T, typename Queue>
+	bool TopicIndex<T, Queue>::IsClosed(const Subscriber& subscriber)
+	{
+		ConnectionPtr connection = subscriber.connection.lock();
+		return !connection || !connection->IsOpen();
+	}
+
+	template<Protocal T, typename Queue>
+	PubSubServer<T, Queue>::PubSubServer(PubSubProtocal<T> protocal, const TcpServerOptions& options) :
+		TcpServer<T, Queue>(StampSender(options)), m_protocal(protocal), m_topics(),
+		m_next_prune(std::chrono::steady_clock::now() + PruneInterval)
+	{
+
+	}
+
+	template<Protocal T, typename Queue>
+	TopicIndex<T, Queue>& PubSubServer<T, Queue>::GetTopics()
+	{
+		return m_topics;
+	}
+
+	template<Protocal T, typename Queue>
+	void PubSubServer<T, Queue>::OnClientConnect(ConnectionPtr& new_connection)
+	{
+		RemoveClosedConnections();
+		this->m_connections[new_connection->GetId()] = new_connection;
+		this->m_connection_count += 1;
+		new_connection->ReadMessage();
+	}
+
+	template<Protocal T, typename Queue>
+	void PubSubServer<T, Queue>::OnClientDisconnect(ConnectionPtr connection)
+	{
+		m_topics.UnsubscribeAll(connection->GetId());
+	}
+
+	template<Protocal T, typename Queue>
+	void PubSubServer<T, Queue>::HandleMessage()
+	{
+		if (std::chrono::steady_clock::now() >= m_next_prune)
+		{
+			std::scoped_lock lock(this->m_connections_mutex);
+			RemoveClosedConnections();
+			m_next_prune = std::chrono::steady_clock::now() + PruneInterval;
+		}
+
+		Message<T> message;
+		while (this->m_message_queue.TryPopMessageIn(message))
+			HandleTopicMessage(message);
+	}
+
+	template<Protocal T, typename Queue>
+	void PubSubServer<T, Queue>::HandleWorkerMessage(Message<T>& message)
+	{
+		HandleTopicMessage(message);
+	}
+
+	template<Protocal T, typename Queue>
+	void PubSubServer<T, Queue>::HandleOtherMessage(Message<T>& message)
+	{
+
+	}
+
+	template<Protocal T, typename Queue>
+	TcpServerOptions PubSubServer<T, Queue>::StampSender(TcpServerOptions options)
+	{
+		options.stamp_sender = true;
+		return options;
+	}
+
+	template<Protocal T, typename Queue>
+	void PubSubServer<T, Queue>::HandleTopicMessage(Message<T>& message)
+	{
+		T protocal = message.header.protocal;
+		if (protocal != m_protocal.subscribe && protocal != m_protocal.unsubscribe && protocal != m_protocal.publish)
+		{
+			HandleOtherMessage(message);
+			return;
+		}
+
+		std::string topic;
+		try
+		{
+			message >> topic;
+		}
+		catch (const std::out_of_range&)
+		{
+			std::cerr << "[SERVER] Topic message without a topic from " << message.header.from << std::endl;
+			return;
+		}
+
+		if (protocal == m_protocal.publish)
+		{
+			message.cursor = 0;
+			m_topics.Publish(topic, std::move(message));
+		}
+		else if (protocal == m_protocal.subscribe)
+		{
+			if (ConnectionPtr connection = FindConnection(message.header.from))
+				m_topics.Subscribe(topic, connection);
+		}
+		else
+		{
+			m_topics.Unsubscribe(topic, message.header.from);
+		}
+	}
+
+	template<Protocal T, typename Queue>
+	void PubSubServer<T, Queue>::RemoveClosedConnections()
+	{
+		for (auto it = this->m_connections.begin(); it != this->m_connections.end();)
+		{
+			if (it->second->IsOpen())
+			{
+				++it;
+				continue;
+			}
+			ConnectionPtr connection = std::move(it->second);
+			it = this->m_connections.erase(it);
+			this->m_connection_count -= 1;
+			OnClientDisconnect(std::move(connection));
+		}
+	}
+
+	template<Protocal T, typename Queue>
+	typename PubSubServer<T, Queue>::ConnectionPtr PubSubServer<T, Queue>::FindConnection(size_t id)
+	{
+		std::scoped_lock lock(this->m_connections_mutex);
+		auto it = this->m_connections.find(id);
+		return it == this->m_connections.end() ? nullptr : it->second;
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "core.hpp"
+#include "connection/connection_stats.h"
+
+namespace net
+{
+	// Server-wide counters, traffic sums up every connection the server accepted, including
+	// those already destroyed.
+	struct ServerStats
+	{
+		uint64_t connections_accepted = 0;
+		// Accepted connections that have not been destroyed yet.
+		uint64_t connections_open = 0;
+		ConnectionStats traffic;
+	};
+
+	// Formats stats in the Prometheus text exposition format, every metric name starts with prefix.
+	inline std::string FormatPrometheus(const ServerStats& stats, std::string_view prefix = "net")
+	{
+		std::string text;
+		auto metric = [&text, prefix](std::string_view name, std::string_view type, std::string_view help, uint64_t value)
+		{
+			std::string full_name = std::string(prefix) + "_" + std::string(name);
+			text += "# HELP " + full_name + " " + std::string(help) + "\n";
+			text += "# TYPE " + full_name + " " + std::string(type) + "\n";
+			text += full_name + " " + std::to_string(value) + "\n";
+		};
+		metric("connections_accepted_total", "counter", "Connections accepted.", stats.connections_accepted);
+		metric("connections_open", "gauge", "Accepted connections not destroyed yet.", stats.connections_open);
+		metric("received_bytes_total", "counter", "Bytes received.", stats.traffic.bytes_in);
+		metric("received_messages_total", "counter", "Messages received.", stats.traffic.messages_in);
+		metric("sent_bytes_total", "counter", "Bytes sent.", stats.traffic.bytes_out);
+		metric("sent_messages_total", "counter", "Messages sent.", stats.traffic.messages_out);
+		metric("send_queue_high_water", "gauge", "Largest outgoing queue of any connection, in messages.", stats.traffic.queue_high_water);
+		metric("write_stalls_total", "counter", "Writes that left messages queued because of the batch limits.", stats.traffic.write_stalls);
+		metric("errors_total", "counter", "Failed connection operations.", stats.traffic.errors);
+		return text;
+	}
+}
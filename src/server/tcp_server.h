@@ -1,55 +1,186 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include "core.hpp"
-#include "connection/Connection.h"
+#include "connection/connection.h"
+#include "connection/shared_frame.h"
+#include "io_context_pool.h"
+#include "server_stats.h"
+#include "worker_pool.h"
 
 using asio::ip::tcp;
 
 namespace net
 {	
+	struct TcpServerOptions
+	{
+		// Port to listen on, 0 picks a free port, see GetPort().
+		uint16_t port = 6000;
+		// Number of I/O threads serving the connections.
+		size_t thread_count = 1;
+		// Open one acceptor per I/O thread, all bound to port with SO_REUSEPORT, so the kernel
+		// spreads incoming connections over the threads and each connection stays on the thread
+		// that accepted it. Without it, one acceptor hands connections out round robin. Ignored
+		// where SO_REUSEPORT is not available.
+		bool sharded_accept = false;
+		// If not empty, Start() rewrites this file with GetStats() in Prometheus text format every
+		// metrics_interval. The file is replaced atomically, so it can be read by a node exporter.
+		std::string metrics_file;
+		std::chrono::milliseconds metrics_interval{ 1000 };
+		// If not 0, serve GetStats() in Prometheus text format over HTTP on this port, for scraping.
+		uint16_t metrics_port = 0;
+		// Address the metrics port is bound to. Only local scrapers can reach it unless it is changed,
+		// e.g. to "0.0.0.0" for every interface.
+		std::string metrics_address = "127.0.0.1";
+		// Forward every frame whose header.dest is the id of another connection straight to it on
+		// the I/O thread that received it. Such frames never reach the message queue. header.from
+		// is whatever the sender wrote unless stamp_sender is set too.
+		bool route_by_dest = false;
+		// Set header.from of every received message, queued or routed, to the id of the
+		// connection it arrived on, see Connection::SetStampSender().
+		bool stamp_sender = false;
+		// If not 0, Start() hands the received messages to this many worker threads calling
+		// HandleWorkerMessage() instead of calling HandleMessage(). The messages of one connection
+		// are handled in order, one at a time, those of different connections in parallel.
+		// Implies stamp_sender: header.from then holds the unique id the server gave the connection,
+		// which picks its place in the pool whatever the client wrote there.
+		size_t worker_count = 0;
+		// Largest message body in bytes accepted from a client. A client announcing a larger body
+		// is disconnected with protocol_error, see Connection::SetMaxBodySize().
+		size_t max_body_size = wire::DefaultMaxBodyBytes;
+	};
+
 	// It is a template server class that open a socket and accept new connection
 	// asynchronously. Users can override the virtual function OnClientConnect()
 	// to perform upcoming processing where there is a new connection request accepted.
 	// Protocal is the common communication rules between server and clients.
-	template<Protocal T>
+	// Queue stores the messages received from all clients, e.g. MessageQueue<T, MpscQueue>
+	// for a lock-free queue when HandleMessage() is the only consumer.
+	// Network I/O runs on a pool of io_context threads, each connection is bound to one of them.
+	template<Protocal T, typename Queue = MessageQueue<T>>
 	class TcpServer
 	{
 	public:
-		// Default constructor
-		TcpServer();
-		// Start to listen the connection request asynchronously. 
-		// Users should not override this function.
+		// Create a server listening on options.port, served by options.thread_count I/O threads.
+		explicit TcpServer(const TcpServerOptions& options = TcpServerOptions());
+		// Start to listen the connection request asynchronously, then handle received messages
+		// until Stop() is called. Users should not override this function.
 		void Start();
+		// Stop accepting connections and make Start() return, may be called from any thread.
+		// Start() stops the I/O threads and releases the connections before it returns, their
+		// sockets are closed once the last pending operation is destroyed with the server.
+		void Stop();
+		// Returns the port the server listens on, useful when it was created with port 0.
+		uint16_t GetPort() const;
+		// Returns the counters summed over every connection accepted so far, may be called from any thread.
+		ServerStats GetStats();
+		// Send a message to every open connection in m_connections. The frame is encoded once and
+		// each connection only queues a reference to it. Returns the number of connections it was
+		// queued on. Takes m_connections_mutex, so it must not be called from OnClientConnect(),
+		// use Connection::WriteFrame() there.
+		size_t Broadcast(const Message<T>& message);
+		size_t Broadcast(SharedFramePtr<T> frame);
+		// Same as Broadcast(), but only to the open connections whose id is in ids.
+		size_t Multicast(const Message<T>& message, std::span<const size_t> ids);
+		size_t Multicast(SharedFramePtr<T> frame, std::span<const size_t> ids);
 	protected:
-		using ConnectionPtr = std::shared_ptr<Connection<T>>;
+		using ConnectionPtr = std::shared_ptr<Connection<T, Queue>>;
 		// This function will be called when there is a new connection request.
 		// Users can override this class for further processing. The newly accepted
-		// connection will be passed as the argument of this function.
+		// connection will be passed as the argument of this function. Calls are serialized
+		// by m_connections_mutex, even when several acceptors run on different threads.
 		virtual void OnClientConnect(ConnectionPtr& new_connection);
 		virtual void OnClientDisconnect(ConnectionPtr connection);
+		// This function will be called by Start() whenever the message queue is not empty.
 		virtual void HandleMessage();
+		// Called on a worker thread for every received message if options.worker_count is not 0.
+		// Calls for different connections may run at the same time.
+		virtual void HandleWorkerMessage(Message<T>& message);
 	private:
-		// Start an asynchronous accept.
-		void StartAccept();
-		// Callback function that will be called where there is a new connection arrived.
-		void HandleAccept(const asio::error_code& error, tcp::socket peer);
+		// Longest HTTP request header accepted on the metrics port.
+		static constexpr size_t MaxRequestBytes = 8192;
+
+		// Open an acceptor on the I/O thread index, sharing the port with the other shards if shared.
+		void OpenAcceptor(size_t index, uint16_t port, bool shared);
+		// Start an asynchronous accept on the acceptor index. A sharded acceptor keeps the new connection
+		// on its own I/O thread, a single acceptor hands it to the next I/O thread of the pool.
+		void StartAccept(size_t index);
+		// Callback function that will be called where there is a new connection arrived. Gives the
+		// connection a unique id before OnClientConnect(). Stops accepting once the acceptor was
+		// closed by Stop().
+		void HandleAccept(size_t index, asio::io_context& io_context, const asio::error_code& error, tcp::socket peer);
+		// Write GetStats() to the metrics file through a temporary file.
+		void WriteMetricsFile();
+		// Answer every HTTP request on the metrics port with GetStats(), one request per connection.
+		void StartMetricsAccept();
+		// Move every message in the message queue to the worker pool, keyed on the id of its
+		// connection stamped into header.from.
+		void SubmitToWorkers();
 	protected:
 		std::unordered_map<size_t, ConnectionPtr> m_connections;
-		MessageQueue<T> m_message_queue;
+		Queue m_message_queue;
+		// Free for subclasses to count the connections they keep, ids do not depend on it.
 		size_t m_connection_count;
+		// Id of the first accepted connection, the next ones count up from it in accept order.
 		size_t m_id;
+		std::mutex m_connections_mutex;
 	private:
-		asio::io_context m_io_context;
-		tcp::acceptor m_acceptor;
-		std::thread m_thread;
+		IoContextPool m_io_context_pool;
+		std::vector<tcp::acceptor> m_acceptors;
+		bool m_sharded_accept;
+		std::atomic<bool> m_stopped;
+		// Counters of every accepted connection. Those only referenced here belong to destroyed
+		// connections and are folded into m_retired_stats by GetStats().
+		std::vector<std::shared_ptr<const ConnectionCounters>> m_counters;
+		ConnectionStats m_retired_stats;
+		uint64_t m_accepted;
+		std::mutex m_stats_mutex;
+		std::string m_metrics_file;
+		std::chrono::milliseconds m_metrics_interval;
+		std::unique_ptr<tcp::acceptor> m_metrics_acceptor;
+		// Set if frames are routed by header.dest, holds every accepted connection.
+		std::shared_ptr<Router<T, Queue>> m_router;
+		bool m_stamp_sender;
+		size_t m_max_body_size;
+		// Set if options.worker_count is not 0.
+		std::unique_ptr<WorkerPool<Message<T>>> m_workers;
 	};
 
-	template<Protocal T>
-	TcpServer<T>::TcpServer() : m_io_context(),
-		m_acceptor(m_io_context, tcp::endpoint(tcp::v4(), 6000)), 
-		m_message_queue(), m_connection_count(0), m_id(1000)
+	template<Protocal T, typename Queue>
+	TcpServer<T, Queue>::TcpServer(const TcpServerOptions& options) : m_message_queue(), m_connection_count(0), m_id(1000),
+		m_io_context_pool(options.thread_count), m_acceptors(), m_sharded_accept(false), m_stopped(false),
+		m_counters(), m_retired_stats(), m_accepted(0), m_metrics_file(options.metrics_file), m_metrics_interval(options.metrics_interval),
+		m_router(options.route_by_dest ? std::make_shared<Router<T, Queue>>() : nullptr), m_stamp_sender(options.stamp_sender || options.worker_count != 0),
+		m_max_body_size(options.max_body_size)
 	{
+		if (options.worker_count != 0)
+		{
+			m_workers = std::make_unique<WorkerPool<Message<T>>>(options.worker_count,
+				[this](Message<T>& message) { HandleWorkerMessage(message); });
+		}
+#if defined(SO_REUSEPORT)
+		m_sharded_accept = options.sharded_accept && m_io_context_pool.Size() > 1;
+#endif
+		// The other shards join the port of the first, which is only known after binding it if
+		// options.port is 0.
+		OpenAcceptor(0, options.port, m_sharded_accept);
+		size_t acceptor_count = m_sharded_accept ? m_io_context_pool.Size() : 1;
+		for (size_t i = 1; i < acceptor_count; ++i)
+			OpenAcceptor(i, GetPort(), true);
+		if (options.metrics_port != 0)
+		{
+			m_metrics_acceptor = std::make_unique<tcp::acceptor>(m_io_context_pool.GetIoContext(0),
+				tcp::endpoint(asio::ip::make_address(options.metrics_address), options.metrics_port));
+		}
+
 		try
 		{
 			std::cout << "[SERVER] Started!" << std::endl;
@@ -60,56 +191,272 @@ namespace net
 		}
 	}
 
-	template<Protocal T>
-	void TcpServer<T>::Start()
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::OpenAcceptor(size_t index, uint16_t port, bool shared)
+	{
+		tcp::endpoint endpoint(tcp::v4(), port);
+		tcp::acceptor acceptor(m_io_context_pool.GetIoContext(index));
+		acceptor.open(endpoint.protocol());
+		acceptor.set_option(tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+		if (shared)
+			acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+		acceptor.bind(endpoint);
+		acceptor.listen();
+		m_acceptors.push_back(std::move(acceptor));
+	}
+
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::Start()
 	{
-		StartAccept();
-		m_thread = std::thread([this]() { m_io_context.run(); });
-		while (true)
+		for (size_t i = 0; i < m_acceptors.size(); ++i)
+			StartAccept(i);
+		if (m_metrics_acceptor)
+			StartMetricsAccept();
+		m_io_context_pool.Run();
+		if (m_workers)
+			m_workers->Run();
+		auto next_metrics = std::chrono::steady_clock::now() + m_metrics_interval;
+		while (!m_stopped.load(std::memory_order_acquire))
 		{
-			HandleMessage();
+			if (m_message_queue.WaitMessageIn(std::chrono::milliseconds(100)))
+			{
+				if (m_workers)
+					SubmitToWorkers();
+				else
+					HandleMessage();
+			}
+			if (!m_metrics_file.empty() && std::chrono::steady_clock::now() >= next_metrics)
+			{
+				WriteMetricsFile();
+				next_metrics += m_metrics_interval;
+			}
 		}
+
+		if (m_workers)
+			m_workers->Stop();
+		m_io_context_pool.Stop();
+		std::scoped_lock lock(m_connections_mutex);
+		m_connections.clear();
 	}
 
-	template<Protocal T>
-	void TcpServer<T>::OnClientConnect(ConnectionPtr& new_connection)
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::Stop()
 	{
+		if (m_stopped.exchange(true, std::memory_order_acq_rel))
+			return;
+		// The acceptors belong to the I/O threads, close them there.
+		for (tcp::acceptor& acceptor : m_acceptors)
+			asio::post(acceptor.get_executor(), [&acceptor]() { acceptor.close(); });
+		if (m_metrics_acceptor)
+			asio::post(m_metrics_acceptor->get_executor(), [this]() { m_metrics_acceptor->close(); });
+	}
 
+	template<Protocal T, typename Queue>
+	uint16_t TcpServer<T, Queue>::GetPort() const
+	{
+		return m_acceptors.front().local_endpoint().port();
 	}
 
-	template<Protocal T>
-	void TcpServer<T>::OnClientDisconnect(ConnectionPtr connection)
+	template<Protocal T, typename Queue>
+	ServerStats TcpServer<T, Queue>::GetStats()
 	{
+		std::scoped_lock lock(m_stats_mutex);
+		ServerStats stats;
+		stats.connections_accepted = m_accepted;
+		std::erase_if(m_counters, [this](const std::shared_ptr<const ConnectionCounters>& counters)
+		{
+			if (counters.use_count() > 1)
+				return false;
+			m_retired_stats += counters->Snapshot();
+			return true;
+		});
+		stats.traffic = m_retired_stats;
+		for (const std::shared_ptr<const ConnectionCounters>& counters : m_counters)
+			stats.traffic += counters->Snapshot();
+		stats.connections_open = m_counters.size();
+		return stats;
+	}
 
+	template<Protocal T, typename Queue>
+	size_t TcpServer<T, Queue>::Broadcast(const Message<T>& message)
+	{
+		return Broadcast(SharedFrame<T>::Encode(message));
 	}
 
-	template<Protocal T>
-	void TcpServer<T>::HandleMessage()
+	template<Protocal T, typename Queue>
+	size_t TcpServer<T, Queue>::Broadcast(SharedFramePtr<T> frame)
 	{
+		std::scoped_lock lock(m_connections_mutex);
+		size_t sent = 0;
+		for (auto& [id, connection] : m_connections)
+		{
+			if (connection && connection->IsOpen())
+			{
+				connection->WriteFrame(frame);
+				sent += 1;
+			}
+		}
+		return sent;
+	}
 
+	template<Protocal T, typename Queue>
+	size_t TcpServer<T, Queue>::Multicast(const Message<T>& message, std::span<const size_t> ids)
+	{
+		return Multicast(SharedFrame<T>::Encode(message), ids);
 	}
 
-	template<Protocal T>
-	void TcpServer<T>::StartAccept()
+	template<Protocal T, typename Queue>
+	size_t TcpServer<T, Queue>::Multicast(SharedFramePtr<T> frame, std::span<const size_t> ids)
 	{
-		m_acceptor.async_accept(std::bind(&TcpServer::HandleAccept, this, std::placeholders::_1, std::placeholders::_2));
+		std::scoped_lock lock(m_connections_mutex);
+		size_t sent = 0;
+		for (size_t id : ids)
+		{
+			auto it = m_connections.find(id);
+			if (it != m_connections.end() && it->second && it->second->IsOpen())
+			{
+				it->second->WriteFrame(frame);
+				sent += 1;
+			}
+		}
+		return sent;
 	}
 
-	template<Protocal T>
-	void TcpServer<T>::HandleAccept(const asio::error_code& error, tcp::socket peer)
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::WriteMetricsFile()
+	{
+		std::string text = FormatPrometheus(GetStats());
+		std::string temporary = m_metrics_file + ".tmp";
+		{
+			std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+			file << text;
+			if (!file)
+			{
+				std::cerr << "Cannot write metrics to " << temporary << std::endl;
+				return;
+			}
+		}
+		// Unlike std::rename, std::filesystem::rename replaces an existing file on Windows too.
+		std::error_code error;
+		std::filesystem::rename(temporary, m_metrics_file, error);
+		if (error)
+		{
+			std::cerr << "Cannot replace metrics file " << m_metrics_file << ": " << error.message() << std::endl;
+			std::filesystem::remove(temporary, error);
+		}
+	}
+
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::StartMetricsAccept()
+	{
+		m_metrics_acceptor->async_accept([this](const asio::error_code& error, tcp::socket peer)
+		{
+			if (!m_metrics_acceptor->is_open())
+				return;
+			if (!error)
+			{
+				// Read the request before answering, closing with unread data would reset the connection.
+				auto socket = std::make_shared<tcp::socket>(std::move(peer));
+				auto request = std::make_shared<std::string>();
+				// A request longer than MaxRequestBytes without its end fails the read and drops the connection.
+				asio::async_read_until(*socket, asio::dynamic_buffer(*request, MaxRequestBytes), "\r\n\r\n",
+					[this, socket, request](const asio::error_code& error, size_t)
+				{
+					if (error)
+						return;
+					std::string body = FormatPrometheus(GetStats());
+					auto response = std::make_shared<std::string>(
+						"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+						std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+					asio::async_write(*socket, asio::buffer(*response), [socket, response](const asio::error_code&, size_t)
+					{
+						asio::error_code ignored;
+						socket->shutdown(tcp::socket::shutdown_both, ignored);
+					});
+				});
+			}
+			StartMetricsAccept();
+		});
+	}
+
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::OnClientConnect(ConnectionPtr& new_connection)
+	{
+
+	}
+
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::OnClientDisconnect(ConnectionPtr connection)
+	{
+
+	}
+
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::HandleMessage()
+	{
+
+	}
+
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::HandleWorkerMessage(Message<T>& message)
+	{
+
+	}
+
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::SubmitToWorkers()
+	{
+		Message<T> message;
+		while (m_message_queue.TryPopMessageIn(message))
+			m_workers->Submit(message.header.from, std::move(message));
+	}
+
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::StartAccept(size_t index)
+	{
+		asio::io_context& io_context = m_sharded_accept ? m_io_context_pool.GetIoContext(index) : m_io_context_pool.GetIoContext();
+		m_acceptors[index].async_accept(io_context,
+			std::bind(&TcpServer::HandleAccept, this, index, std::ref(io_context), std::placeholders::_1, std::placeholders::_2));
+	}
+
+	template<Protocal T, typename Queue>
+	void TcpServer<T, Queue>::HandleAccept(size_t index, asio::io_context& io_context, const asio::error_code& error, tcp::socket peer)
 	{
 		if (!error)
 		{
-			ConnectionPtr new_connection = 
-				std::make_shared<Connection<T>>(m_connection_count + m_id, m_io_context, std::move(peer), m_message_queue);
+			// Batching is done by the connection, see WriteBatchOptions, kernel Nagle would only
+			// hold small writes back until the peer's delayed ACK.
+			asio::error_code ignored;
+			peer.set_option(tcp::no_delay(true), ignored);
+			std::scoped_lock lock(m_connections_mutex);
+			ConnectionPtr new_connection;
+			{
+				std::scoped_lock stats_lock(m_stats_mutex);
+				new_connection = std::make_shared<Connection<T, Queue>>(m_id + m_accepted, io_context, std::move(peer), m_message_queue);
+				m_counters.push_back(new_connection->GetCounters());
+				m_accepted += 1;
+			}
+			new_connection->SetStampSender(m_stamp_sender);
+			new_connection->SetMaxBodySize(m_max_body_size);
+			if (m_router)
+			{
+				new_connection->SetRouter(m_router);
+				m_router->Add(new_connection);
+			}
 			OnClientConnect(new_connection);
 		}
+		else if (!m_acceptors[index].is_open())
+		{
+			return;
+		}
 		else
 		{
 			std::cerr << error.message() << std::endl;
 		}
 
-		StartAccept();
+		StartAccept(index);
 	}
 }
 
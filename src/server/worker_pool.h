@@ -0,0 +1,221 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "core.hpp"
+
+namespace net
+{
+	// A pool of threads handling items in parallel while keeping the items of one key in order.
+	// Keys are hashed onto mailboxes, each handled by one worker at a time, so items with the same
+	// key run one after another in the order they were submitted. A mailbox with items waits on the
+	// run queue of its home worker, an idle worker steals waiting mailboxes from the others, so a
+	// busy worker does not hold back the mailboxes queued behind it. A worker takes every item of
+	// a mailbox at once and puts the mailbox back behind the others if more arrived meanwhile.
+	template<typename Item>
+	class WorkerPool
+	{
+	public:
+		using Handler = std::function<void(Item&)>;
+
+		// Create worker_count workers calling handler, over worker_count * MailboxesPerWorker mailboxes.
+		WorkerPool(size_t worker_count, Handler handler);
+		// Stops the workers and joins their threads.
+		~WorkerPool();
+		WorkerPool(const WorkerPool&) = delete;
+		WorkerPool& operator=(const WorkerPool&) = delete;
+		// Start the worker threads.
+		void Run();
+		// Stop the workers once they finished the items they hold and wait for the threads to
+		// finish. Items still waiting in mailboxes are dropped.
+		void Stop();
+		// Queue item behind the items submitted with the same key before, may be called from any thread.
+		void Submit(size_t key, Item&& item);
+		size_t Size() const;
+	private:
+		static constexpr size_t MailboxesPerWorker = 64;
+
+		struct Mailbox
+		{
+			std::mutex mutex;
+			std::vector<Item> items;
+			// Set while the mailbox is on a run queue or being handled.
+			bool scheduled = false;
+			size_t home = 0;
+		};
+
+		struct RunQueue
+		{
+			std::mutex mutex;
+			std::deque<Mailbox*> mailboxes;
+		};
+
+		// Put mailbox on the run queue of worker and wake an idle worker.
+		void Schedule(size_t worker, Mailbox* mailbox);
+		// Returns the first mailbox of the run queue of worker, or one stolen from the back of the
+		// run queue of another worker, nullptr if all are empty.
+		Mailbox* Take(size_t worker);
+		void Work(size_t worker);
+	private:
+		Handler m_handler;
+		std::vector<std::unique_ptr<Mailbox>> m_mailboxes;
+		std::vector<std::unique_ptr<RunQueue>> m_run_queues;
+		std::vector<std::thread> m_threads;
+		// Mailboxes waiting on the run queues.
+		std::atomic<size_t> m_ready;
+		std::atomic<size_t> m_sleeping;
+		std::atomic<bool> m_stopped;
+		std::mutex m_wait_mutex;
+		std::condition_variable m_wait_condition;
+	};
+
+	template<typename Item>
+	WorkerPool<Item>::WorkerPool(size_t worker_count, Handler handler) : m_handler(std::move(handler)),
+		m_mailboxes(), m_run_queues(), m_threads(), m_ready(0), m_sleeping(0), m_stopped(false)
+	{
+		if (worker_count == 0)
+			worker_count = 1;
+		for (size_t i = 0; i < worker_count; ++i)
+			m_run_queues.push_back(std::make_unique<RunQueue>());
+		for (size_t i = 0; i < worker_count * MailboxesPerWorker; ++i)
+		{
+			m_mailboxes.push_back(std::make_unique<Mailbox>());
+			m_mailboxes.back()->home = i % worker_count;
+		}
+	}
+
+	template<typename Item>
+	WorkerPool<Item>::~WorkerPool()
+	{
+		Stop();
+	}
+
+	template<typename Item>
+	void WorkerPool<Item>::Run()
+	{
+		m_stopped.store(false);
+		for (size_t i = 0; i < m_run_queues.size(); ++i)
+			m_threads.emplace_back([this, i]() { Work(i); });
+	}
+
+	template<typename Item>
+	void WorkerPool<Item>::Stop()
+	{
+		{
+			std::scoped_lock lock(m_wait_mutex);
+			m_stopped.store(true);
+		}
+		m_wait_condition.notify_all();
+		for (std::thread& thread : m_threads)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+		m_threads.clear();
+	}
+
+	template<typename Item>
+	void WorkerPool<Item>::Submit(size_t key, Item&& item)
+	{
+		Mailbox* mailbox = m_mailboxes[std::hash<size_t>{}(key) % m_mailboxes.size()].get();
+		{
+			std::scoped_lock lock(mailbox->mutex);
+			mailbox->items.push_back(std::move(item));
+			if (mailbox->scheduled)
+				return;
+			mailbox->scheduled = true;
+		}
+		Schedule(mailbox->home, mailbox);
+	}
+
+	template<typename Item>
+	size_t WorkerPool<Item>::Size() const
+	{
+		return m_run_queues.size();
+	}
+
+	template<typename Item>
+	void WorkerPool<Item>::Schedule(size_t worker, Mailbox* mailbox)
+	{
+		{
+			std::scoped_lock lock(m_run_queues[worker]->mutex);
+			m_run_queues[worker]->mailboxes.push_back(mailbox);
+		}
+		// A worker going to sleep counts itself in m_sleeping before it checks m_ready, so either it
+		// sees this mailbox or it is counted here and gets notified.
+		m_ready.fetch_add(1);
+		if (m_sleeping.load() != 0)
+		{
+			std::scoped_lock lock(m_wait_mutex);
+			m_wait_condition.notify_one();
+		}
+	}
+
+	template<typename Item>
+	typename WorkerPool<Item>::Mailbox* WorkerPool<Item>::Take(size_t worker)
+	{
+		size_t count = m_run_queues.size();
+		for (size_t i = 0; i < count; ++i)
+		{
+			RunQueue& queue = *m_run_queues[(worker + i) % count];
+			std::scoped_lock lock(queue.mutex);
+			if (queue.mailboxes.empty())
+				continue;
+			Mailbox* mailbox = nullptr;
+			if (i == 0)
+			{
+				mailbox = queue.mailboxes.front();
+				queue.mailboxes.pop_front();
+			}
+			else
+			{
+				mailbox = queue.mailboxes.back();
+				queue.mailboxes.pop_back();
+			}
+			m_ready.fetch_sub(1);
+			return mailbox;
+		}
+		return nullptr;
+	}
+
+	template<typename Item>
+	void WorkerPool<Item>::Work(size_t worker)
+	{
+		// Swapped with the items of each mailbox, so the two buffers are reused instead of reallocated.
+		std::vector<Item> items;
+		while (!m_stopped.load())
+		{
+			Mailbox* mailbox = Take(worker);
+			if (mailbox == nullptr)
+			{
+				std::unique_lock lock(m_wait_mutex);
+				m_sleeping.fetch_add(1);
+				m_wait_condition.wait(lock, [this]() { return m_ready.load() != 0 || m_stopped.load(); });
+				m_sleeping.fetch_sub(1);
+				continue;
+			}
+
+			{
+				std::scoped_lock lock(mailbox->mutex);
+				items.swap(mailbox->items);
+			}
+			for (Item& item : items)
+				m_handler(item);
+			items.clear();
+			{
+				std::scoped_lock lock(mailbox->mutex);
+				if (mailbox->items.empty())
+				{
+					mailbox->scheduled = false;
+					continue;
+				}
+			}
+			Schedule(worker, mailbox);
+		}
+	}
+}
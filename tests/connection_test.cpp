@@ -0,0 +1,222 @@
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include "test.h"
+#include "connection/connection.h"
+#include "connection/coro_connection.h"
+
+namespace
+{
+	enum class Protocal
+	{
+		DATA
+	};
+
+	using TestConnection = net::Connection<Protocal>;
+	using TestCoroConnection = net::CoroConnection<Protocal>;
+
+	// Runs io_context on thread_count threads until it is destroyed.
+	class IoThreads
+	{
+	public:
+		explicit IoThreads(size_t thread_count) : m_work_guard(asio::make_work_guard(m_io_context))
+		{
+			for (size_t i = 0; i < thread_count; ++i)
+				m_threads.emplace_back([this]() { m_io_context.run(); });
+		}
+
+		~IoThreads()
+		{
+			m_work_guard.reset();
+			for (std::thread& thread : m_threads)
+				thread.join();
+		}
+
+		asio::io_context& GetIoContext()
+		{
+			return m_io_context;
+		}
+	private:
+		asio::io_context m_io_context;
+		asio::executor_work_guard<asio::io_context::executor_type> m_work_guard;
+		std::vector<std::thread> m_threads;
+	};
+
+	// The peer of a connection resets it, after which the connection keeps being written to.
+	// Once the failed write closed it, further messages must be dropped instead of queued.
+	template<typename ConnectionType>
+	void CheckWritesAfterPeerReset()
+	{
+		constexpr size_t WritesAfterReset = 10000;
+
+		IoThreads io_threads(1);
+		asio::io_context& io_context = io_threads.GetIoContext();
+		net::MessageQueue<Protocal> queue;
+		tcp::acceptor acceptor(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+		tcp::socket peer(io_context);
+		peer.connect(acceptor.local_endpoint());
+		auto connection = std::make_shared<ConnectionType>(0, io_context, acceptor.accept(io_context), queue);
+
+		// A zero linger time makes close() send a reset instead of a FIN.
+		peer.set_option(asio::socket_base::linger(true, 0));
+		peer.close();
+
+		net::Message<Protocal>::body_type body(64, 1);
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (connection->GetStats().errors == 0 && std::chrono::steady_clock::now() < deadline)
+		{
+			connection->WriteMessage(net::Message<Protocal>::ConstructMessage(Protocal::DATA, body));
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		NET_CHECK(connection->GetStats().errors > 0);
+		// The failed write closes the socket on the strand right after counting the error.
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+		for (size_t i = 0; i < WritesAfterReset; ++i)
+			connection->WriteMessage(net::Message<Protocal>::ConstructMessage(Protocal::DATA, body));
+		NET_CHECK(connection->GetStats().queue_high_water < 100);
+
+		std::weak_ptr<ConnectionType> alive = connection;
+		connection.reset();
+		while (!alive.expired() && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		NET_CHECK(alive.expired());
+	}
+}
+
+// Both ends of many loopback connections run on one io_context served by several threads, so
+// the handlers of a connection can land on any of them. Writer threads send on random
+// connections while others disconnect them and every reference is released with operations
+// still pending. Nothing may crash or race, and every connection has to be destroyed once its
+// last handler has run.
+NET_TEST(connection_write_disconnect_stress)
+{
+	constexpr size_t Pairs = 32;
+	constexpr size_t Writers = 8;
+	constexpr size_t WritesPerWriter = 5000;
+	constexpr size_t Rounds = 4;
+
+	IoThreads io_threads(4);
+	asio::io_context& io_context = io_threads.GetIoContext();
+	net::MessageQueue<Protocal> queue;
+	tcp::acceptor acceptor(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+
+	for (size_t round = 0; round < Rounds; ++round)
+	{
+		std::vector<std::shared_ptr<TestConnection>> connections;
+		for (size_t i = 0; i < Pairs; ++i)
+		{
+			tcp::socket client(io_context);
+			client.connect(acceptor.local_endpoint());
+			tcp::socket server = acceptor.accept(io_context);
+			connections.push_back(std::make_shared<TestConnection>(2 * i, io_context, std::move(client), queue));
+			connections.push_back(std::make_shared<TestConnection>(2 * i + 1, io_context, std::move(server), queue));
+		}
+		for (const std::shared_ptr<TestConnection>& connection : connections)
+			connection->ReadMessage();
+		std::vector<std::weak_ptr<TestConnection>> alive(connections.begin(), connections.end());
+
+		std::atomic<bool> go{ false };
+		std::atomic<size_t> written{ 0 };
+		std::vector<std::thread> threads;
+		for (size_t writer = 0; writer < Writers; ++writer)
+		{
+			threads.emplace_back([&connections, &go, &written, writer, round]()
+			{
+				std::mt19937 random(static_cast<uint32_t>(writer * Rounds + round));
+				net::Message<Protocal>::body_type body(64 + writer * 100, 1);
+				while (!go.load())
+					std::this_thread::yield();
+				for (size_t i = 0; i < WritesPerWriter; ++i)
+				{
+					TestConnection& connection = *connections[random() % connections.size()];
+					if (i % 2 == 0)
+						connection.WriteMessage(net::Message<Protocal>::ConstructMessage(Protocal::DATA, body));
+					else
+						connection.WriteMessage(net::Message<Protocal>::ConstructMessage(Protocal::DATA, i, 0, body));
+					written.fetch_add(1, std::memory_order_relaxed);
+				}
+			});
+		}
+		// Disconnect every connection, some of them more than once, while the writers are busy.
+		threads.emplace_back([&connections, &written]()
+		{
+			while (written.load(std::memory_order_relaxed) < Writers * WritesPerWriter / 4)
+				std::this_thread::yield();
+			for (size_t i = 0; i < connections.size(); ++i)
+			{
+				connections[(i * 7) % connections.size()]->Disconnect();
+				if (i % 3 == 0)
+					connections[i]->Disconnect();
+				std::this_thread::sleep_for(std::chrono::microseconds(200));
+			}
+		});
+		go.store(true);
+		for (std::thread& thread : threads)
+			thread.join();
+
+		for (const std::shared_ptr<TestConnection>& connection : connections)
+		{
+			// Writes queued after the close fail on the strand, the connection just has to survive them.
+			connection->WriteMessage(net::Message<Protocal>::ConstructMessage(Protocal::DATA, {}));
+		}
+		connections.clear();
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		bool destroyed = false;
+		while (!destroyed && std::chrono::steady_clock::now() < deadline)
+		{
+			destroyed = true;
+			for (const std::weak_ptr<TestConnection>& connection : alive)
+				destroyed = destroyed && connection.expired();
+			if (!destroyed)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		NET_CHECK(destroyed);
+
+		net::Message<Protocal> message;
+		while (queue.TryPopMessageIn(message))
+			NET_CHECK(message.header.protocal == Protocal::DATA);
+	}
+}
+
+NET_TEST(connection_writes_after_peer_reset)
+{
+	CheckWritesAfterPeerReset<TestConnection>();
+}
+
+NET_TEST(coro_connection_writes_after_peer_reset)
+{
+	CheckWritesAfterPeerReset<TestCoroConnection>();
+}
+
+// A connection given a router takes its id out of the router's table once it is closed, while it
+// is still alive.
+NET_TEST(connection_leaves_router_on_close)
+{
+	IoThreads io_threads(1);
+	asio::io_context& io_context = io_threads.GetIoContext();
+	net::MessageQueue<Protocal> queue;
+	tcp::acceptor acceptor(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+	tcp::socket peer(io_context);
+	peer.connect(acceptor.local_endpoint());
+	auto router = std::make_shared<net::Router<Protocal, net::MessageQueue<Protocal>>>();
+	auto connection = std::make_shared<TestConnection>(7, io_context, acceptor.accept(io_context), queue);
+	connection->SetRouter(router);
+	router->Add(connection);
+	connection->ReadMessage();
+	NET_CHECK(router->GetTable()->contains(7));
+
+	connection->Disconnect();
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (router->GetTable()->contains(7) && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	NET_CHECK(!router->GetTable()->contains(7));
+	// Removing an id that is not routed leaves the table alone.
+	std::shared_ptr<const net::Router<Protocal, net::MessageQueue<Protocal>>::Table> table = router->GetTable();
+	router->Remove(7);
+	NET_CHECK(router->GetTable() == table);
+}
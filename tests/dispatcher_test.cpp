@@ -0,0 +1,95 @@
+#include "test.h"
+#include "connection/dispatcher.h"
+
+namespace
+{
+	enum class Protocal
+	{
+		LOGIN,
+		CHAT,
+		MOVE,
+		UNKNOWN
+	};
+
+	struct Session
+	{
+		int logins = 0;
+		int chats = 0;
+		size_t last_body = 0;
+
+		void Login(net::Message<Protocal>& message)
+		{
+			logins += 1;
+			last_body = message.body.size();
+		}
+	};
+
+	void Chat(Session& session, net::Message<Protocal>& message)
+	{
+		session.chats += 1;
+		session.last_body = message.body.size();
+	}
+
+	int moves = 0;
+
+	void Move(net::Message<Protocal>&)
+	{
+		moves += 1;
+	}
+
+	using SessionDispatcher = net::Dispatcher<Protocal,
+		net::Handler<Protocal::LOGIN, &Session::Login>,
+		net::Handler<Protocal::CHAT, &Chat>,
+		net::Handler<Protocal::MOVE, [](Session&, net::Message<Protocal>& message) { Move(message); }>>;
+
+	net::Message<Protocal> MakeMessage(Protocal protocal, size_t body_size)
+	{
+		return net::Message<Protocal>::ConstructMessage(protocal, net::Message<Protocal>::body_type(body_size));
+	}
+}
+
+NET_TEST(dispatcher_calls_handler)
+{
+	static_assert(SessionDispatcher::Handles(Protocal::LOGIN));
+	static_assert(!SessionDispatcher::Handles(Protocal::UNKNOWN));
+
+	Session session;
+	net::Message<Protocal> login = MakeMessage(Protocal::LOGIN, 3);
+	net::Message<Protocal> chat = MakeMessage(Protocal::CHAT, 5);
+	net::Message<Protocal> move = MakeMessage(Protocal::MOVE, 0);
+	net::Message<Protocal> unknown = MakeMessage(Protocal::UNKNOWN, 0);
+	moves = 0;
+
+	NET_CHECK(SessionDispatcher::Dispatch(login, session));
+	NET_CHECK(session.logins == 1 && session.last_body == 3);
+	NET_CHECK(SessionDispatcher::Dispatch(chat, session));
+	NET_CHECK(session.chats == 1 && session.last_body == 5);
+	NET_CHECK(SessionDispatcher::Dispatch(move, session));
+	NET_CHECK(moves == 1);
+	NET_CHECK(!SessionDispatcher::Dispatch(unknown, session));
+	NET_CHECK(session.logins == 1 && session.chats == 1 && moves == 1);
+
+	// Without handlers nothing is dispatched.
+	NET_CHECK(!(net::Dispatcher<Protocal>::Dispatch(login, session)));
+}
+
+NET_TEST(dispatch_queue)
+{
+	Session session;
+	net::DispatchQueue<Protocal, SessionDispatcher, Session> queue;
+	net::Message<Protocal> message;
+
+	// Until the context is set every message is queued.
+	queue.WriteMessageIn(MakeMessage(Protocal::LOGIN, 1));
+	NET_CHECK(session.logins == 0);
+	NET_CHECK(queue.TryPopMessageIn(message) && message.header.protocal == Protocal::LOGIN);
+
+	queue.SetContext(&session);
+	queue.WriteMessageIn(MakeMessage(Protocal::LOGIN, 1));
+	queue.WriteMessageIn(MakeMessage(Protocal::CHAT, 2));
+	queue.WriteMessageIn(MakeMessage(Protocal::UNKNOWN, 4));
+	NET_CHECK(session.logins == 1);
+	NET_CHECK(session.chats == 1);
+	NET_CHECK(queue.TryPopMessageIn(message) && message.header.protocal == Protocal::UNKNOWN && message.body.size() == 4);
+	NET_CHECK(queue.MessageInEmpty());
+}
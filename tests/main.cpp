@@ -0,0 +1,32 @@
+#include <cstdio>
+#include "test.h"
+
+// Runs every registered test, or only those whose name contains one of the arguments.
+// Returns 1 if any check failed.
+int main(int argc, char* argv[])
+{
+	std::vector<std::string> filters(argv + 1, argv + argc);
+	size_t failed_tests = 0;
+	for (const test::Test& test : test::Registry())
+	{
+		bool selected = filters.empty();
+		for (size_t i = 0; i < filters.size() && !selected; ++i)
+			selected = test.name.find(filters[i]) != std::string::npos;
+		if (!selected)
+			continue;
+
+		size_t failures = test::Failures().load();
+		test.function();
+		bool passed = test::Failures().load() == failures;
+		std::printf("%-40s %s\n", test.name.c_str(), passed ? "ok" : "FAILED");
+		std::fflush(stdout);
+		if (!passed)
+			failed_tests += 1;
+	}
+	if (failed_tests != 0)
+	{
+		std::printf("%zu tests failed\n", failed_tests);
+		return 1;
+	}
+	return 0;
+}
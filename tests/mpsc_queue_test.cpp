@@ -0,0 +1,67 @@
+#include <thread>
+#include <utility>
+#include <vector>
+#include "test.h"
+#include "connection/mpsc_queue.h"
+
+NET_TEST(mpsc_queue_fifo)
+{
+	net::MpscQueue<int> queue;
+	int value = 0;
+	NET_CHECK(queue.Empty());
+	NET_CHECK(!queue.TryPop(value));
+
+	for (int i = 0; i < 100; ++i)
+		queue.Push(i);
+	NET_CHECK(!queue.Empty());
+	NET_CHECK(queue.Front() == 0);
+	queue.Pop();
+	for (int i = 1; i < 100; ++i)
+	{
+		NET_CHECK(queue.TryPop(value));
+		NET_CHECK(value == i);
+	}
+	NET_CHECK(queue.Empty());
+	NET_CHECK(!queue.TryPop(value));
+}
+
+// Producers push concurrently while the single consumer pops, every value arrives exactly once
+// and the values of each producer in the order it pushed them.
+NET_TEST(mpsc_queue_producers)
+{
+	constexpr size_t Producers = 4;
+	constexpr size_t PerProducer = 100000;
+	net::MpscQueue<std::pair<size_t, size_t>> queue;
+
+	std::vector<std::thread> producers;
+	for (size_t producer = 0; producer < Producers; ++producer)
+	{
+		producers.emplace_back([&queue, producer]()
+		{
+			for (size_t i = 0; i < PerProducer; ++i)
+				queue.Push({ producer, i });
+		});
+	}
+
+	std::vector<size_t> next(Producers, 0);
+	size_t received = 0;
+	bool ordered = true;
+	std::pair<size_t, size_t> value;
+	while (received < Producers * PerProducer)
+	{
+		if (!queue.TryPop(value))
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		ordered = ordered && value.first < Producers && value.second == next[value.first];
+		if (value.first < Producers)
+			next[value.first] = value.second + 1;
+		received += 1;
+	}
+	for (std::thread& producer : producers)
+		producer.join();
+
+	NET_CHECK(ordered);
+	NET_CHECK(queue.Empty());
+}
@@ -0,0 +1,99 @@
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include "test.h"
+#include "server/pub_sub.h"
+
+namespace
+{
+	enum class Protocal
+	{
+		SUBSCRIBE,
+		UNSUBSCRIBE,
+		PUBLISH
+	};
+
+	using ClientConnection = net::Connection<Protocal>;
+
+	constexpr std::string_view Topic = "news";
+
+	// Waits until the topic has subscribers subscribers, or a few seconds have passed.
+	bool WaitForSubscribers(net::PubSubServer<Protocal>& server, size_t subscribers)
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (std::chrono::steady_clock::now() < deadline)
+		{
+			auto subscribed = server.GetTopics().GetSubscribers(Topic);
+			if ((subscribed ? subscribed->size() : 0) == subscribers)
+				return true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return false;
+	}
+
+	// One client subscribes, another publishes and the subscriber has to receive the message,
+	// then the subscriber unsubscribes again.
+	void CheckPubSub(size_t worker_count)
+	{
+		net::TcpServerOptions options;
+		options.port = 0;
+		options.worker_count = worker_count;
+		net::PubSubServer<Protocal> server({ Protocal::SUBSCRIBE, Protocal::UNSUBSCRIBE, Protocal::PUBLISH }, options);
+		std::thread server_thread([&server]() { server.Start(); });
+
+		net::IoContextPool client_pool(1);
+		client_pool.Run();
+		net::MessageQueue<Protocal> client_queue;
+		tcp::endpoint endpoint(asio::ip::address_v4::loopback(), server.GetPort());
+		auto connect = [&](size_t id)
+		{
+			asio::io_context& io_context = client_pool.GetIoContext();
+			tcp::socket socket(io_context);
+			socket.connect(endpoint);
+			auto client = std::make_shared<ClientConnection>(id, io_context, std::move(socket), client_queue);
+			client->ReadMessage();
+			return client;
+		};
+
+		std::shared_ptr<ClientConnection> subscriber = connect(0);
+		std::shared_ptr<ClientConnection> publisher = connect(1);
+		subscriber->WriteMessage(net::TopicMessage(Protocal::SUBSCRIBE, Topic));
+		NET_CHECK(WaitForSubscribers(server, 1));
+
+		net::Message<Protocal> publish = net::TopicMessage(Protocal::PUBLISH, Topic);
+		publish << static_cast<int64_t>(42);
+		publisher->WriteMessage(std::move(publish));
+
+		net::Message<Protocal> message;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (!client_queue.TryPopMessageIn(message) && std::chrono::steady_clock::now() < deadline)
+			client_queue.WaitMessageIn(std::chrono::milliseconds(10));
+		std::string topic;
+		int64_t payload = 0;
+		NET_CHECK(message.header.protocal == Protocal::PUBLISH);
+		if (message.header.protocal == Protocal::PUBLISH)
+		{
+			message >> topic >> payload;
+			NET_CHECK(topic == Topic);
+			NET_CHECK(payload == 42);
+		}
+
+		subscriber->WriteMessage(net::TopicMessage(Protocal::UNSUBSCRIBE, Topic));
+		NET_CHECK(WaitForSubscribers(server, 0));
+
+		server.Stop();
+		server_thread.join();
+		client_pool.Stop();
+	}
+}
+
+NET_TEST(pub_sub_server)
+{
+	CheckPubSub(0);
+}
+
+NET_TEST(pub_sub_server_workers)
+{
+	CheckPubSub(2);
+}
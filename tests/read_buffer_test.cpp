@@ -0,0 +1,129 @@
+#include <array>
+#include <cstring>
+#include <vector>
+#include "test.h"
+#include "connection/read_buffer.h"
+
+namespace
+{
+	enum class Protocal
+	{
+		DATA
+	};
+
+	// Returns the encoded frame of a message with body_size bytes counting up from 0.
+	std::vector<uint8_t> EncodeFrame(size_t body_size)
+	{
+		net::Header<Protocal> header{ body_size, 1000, 0, Protocal::DATA };
+		std::vector<uint8_t> frame(net::wire::MaxHeaderSize<Protocal> + body_size);
+		size_t header_size = net::wire::EncodeHeader(header, frame.data());
+		for (size_t i = 0; i < body_size; ++i)
+			frame[header_size + i] = static_cast<uint8_t>(i);
+		frame.resize(header_size + body_size);
+		return frame;
+	}
+
+	// Copies size bytes of data into buffer the way a socket read would.
+	void Receive(net::ReadBuffer& buffer, const uint8_t* data, size_t size)
+	{
+		asio::mutable_buffer space = buffer.Prepare();
+		std::memcpy(space.data(), data, size);
+		buffer.Commit(size);
+	}
+
+	bool BodyCountsUp(const net::Message<Protocal>& message, size_t size)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			if (message.body[i] != static_cast<uint8_t>(i))
+				return false;
+		}
+		return true;
+	}
+}
+
+NET_TEST(read_buffer_partial_frame)
+{
+	std::vector<uint8_t> frame = EncodeFrame(100);
+	net::ReadBuffer buffer(4096);
+	net::FrameInfo<Protocal> info;
+
+	// Every split of the frame is incomplete until its last byte arrives.
+	for (size_t split = 0; split < frame.size(); ++split)
+	{
+		net::ReadBuffer partial(4096);
+		Receive(partial, frame.data(), split);
+		NET_CHECK(net::PeekFrame(partial, info) == net::FrameStatus::Incomplete);
+	}
+
+	Receive(buffer, frame.data(), 10);
+	NET_CHECK(net::PeekFrame(buffer, info) == net::FrameStatus::Incomplete);
+	Receive(buffer, frame.data() + 10, frame.size() - 10);
+	NET_CHECK(net::PeekFrame(buffer, info) == net::FrameStatus::Complete);
+	NET_CHECK(info.body_bytes == 100);
+	NET_CHECK(info.FrameBytes() == frame.size());
+
+	net::Message<Protocal> message;
+	NET_CHECK(net::TakeFrame(buffer, info, message) == 100);
+	NET_CHECK(message.header.size == 100);
+	NET_CHECK(message.header.from == 1000);
+	NET_CHECK(BodyCountsUp(message, 100));
+	NET_CHECK(buffer.Size() == 0);
+}
+
+NET_TEST(read_buffer_back_to_back_frames)
+{
+	std::vector<uint8_t> bytes = EncodeFrame(0);
+	std::vector<uint8_t> second = EncodeFrame(30);
+	bytes.insert(bytes.end(), second.begin(), second.end());
+	net::ReadBuffer buffer(4096);
+	Receive(buffer, bytes.data(), bytes.size());
+
+	net::FrameInfo<Protocal> info;
+	net::Message<Protocal> message;
+	NET_CHECK(net::PeekFrame(buffer, info) == net::FrameStatus::Complete);
+	NET_CHECK(net::TakeFrame(buffer, info, message) == 0);
+	NET_CHECK(message.body.empty());
+	NET_CHECK(net::PeekFrame(buffer, info) == net::FrameStatus::Complete);
+	NET_CHECK(net::TakeFrame(buffer, info, message) == 30);
+	NET_CHECK(BodyCountsUp(message, 30));
+	NET_CHECK(buffer.Size() == 0);
+}
+
+NET_TEST(read_buffer_oversized_frame)
+{
+	std::vector<uint8_t> frame = EncodeFrame(1000);
+	net::ReadBuffer buffer(256);
+	Receive(buffer, frame.data(), 256);
+
+	net::FrameInfo<Protocal> info;
+	NET_CHECK(net::PeekFrame(buffer, info) == net::FrameStatus::Oversized);
+	NET_CHECK(info.body_bytes == 1000);
+
+	// The buffered start of the body is copied, the connection reads the rest into the message.
+	net::Message<Protocal> message;
+	size_t copied = net::TakeFrame(buffer, info, message);
+	NET_CHECK(copied == 256 - info.header_bytes);
+	NET_CHECK(message.body.size() == 1000);
+	NET_CHECK(BodyCountsUp(message, copied));
+	NET_CHECK(buffer.Size() == 0);
+}
+
+NET_TEST(read_buffer_body_limit)
+{
+	std::vector<uint8_t> frame = EncodeFrame(1000);
+	net::ReadBuffer buffer(4096);
+	Receive(buffer, frame.data(), frame.size());
+
+	net::FrameInfo<Protocal> info;
+	NET_CHECK(net::PeekFrame(buffer, info, 999) == net::FrameStatus::Malformed);
+	NET_CHECK(net::PeekFrame(buffer, info, 1000) == net::FrameStatus::Complete);
+
+	// A header announcing a body near SIZE_MAX is rejected before any size is computed from it.
+	std::array<uint8_t, net::wire::MaxHeaderSize<Protocal>> header{};
+	size_t header_size = net::wire::EncodeHeader(net::Header<Protocal>{ SIZE_MAX - 4, 0, 0, Protocal::DATA }, header.data());
+	net::ReadBuffer hostile(64);
+	Receive(hostile, header.data(), header_size);
+	NET_CHECK(net::PeekFrame(hostile, info, SIZE_MAX) == net::FrameStatus::Malformed);
+	NET_CHECK(net::PeekFrame(hostile, info) == net::FrameStatus::Malformed);
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace test
+{
+	// A test is a function registered by name with NET_TEST, it checks its results with NET_CHECK.
+	struct Test
+	{
+		std::string name;
+		std::function<void()> function;
+	};
+
+	inline std::vector<Test>& Registry()
+	{
+		static std::vector<Test> tests;
+		return tests;
+	}
+
+	struct Registrar
+	{
+		Registrar(const char* name, std::function<void()> function)
+		{
+			Registry().push_back({ name, std::move(function) });
+		}
+	};
+
+	// Number of failed checks so far, over all tests.
+	inline std::atomic<size_t>& Failures()
+	{
+		static std::atomic<size_t> failures{ 0 };
+		return failures;
+	}
+
+	// Prints a failed check and counts it, may be called from any thread.
+	inline void Fail(const char* file, int line, const char* expression)
+	{
+		static std::mutex mutex;
+		std::scoped_lock lock(mutex);
+		std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+		Failures().fetch_add(1);
+	}
+}
+
+#define NET_TEST_CONCAT_IMPL(a, b) a##b
+#define NET_TEST_CONCAT(a, b) NET_TEST_CONCAT_IMPL(a, b)
+// Defines and registers a test, the body follows the macro like a function body.
+#define NET_TEST(name) \
+	static void name(); \
+	static test::Registrar NET_TEST_CONCAT(name, _registrar)(#name, name); \
+	static void name()
+// Reports a failure if condition is false and carries on with the test.
+#define NET_CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+			test::Fail(__FILE__, __LINE__, #condition); \
+	} while (false)
@@ -0,0 +1,101 @@
+#include <array>
+#include <cstdint>
+#include "test.h"
+#include "connection/wire_format.h"
+
+namespace
+{
+	enum class Protocal : uint16_t
+	{
+		PING,
+		DATA = 300
+	};
+
+	struct StructProtocal
+	{
+		uint8_t kind;
+		uint8_t flags;
+	};
+
+	template<net::Protocal T>
+	bool RoundTrips(const net::Header<T>& header)
+	{
+		std::array<uint8_t, net::wire::MaxHeaderSize<T>> bytes{};
+		size_t written = net::wire::EncodeHeader(header, bytes.data());
+		if (written != net::wire::EncodedHeaderSize(header))
+			return false;
+
+		net::Header<T> decoded;
+		size_t header_size = 0;
+		if (net::wire::DecodeHeader(bytes.data(), written, decoded, header_size) != net::wire::DecodeResult::Ok)
+			return false;
+		return header_size == written && decoded.size == header.size && decoded.from == header.from &&
+			decoded.dest == header.dest && std::memcmp(&decoded.protocal, &header.protocal, sizeof(T)) == 0;
+	}
+}
+
+NET_TEST(wire_round_trip)
+{
+	for (size_t value : { size_t(0), size_t(1), size_t(127), size_t(128), size_t(16383), size_t(16384), size_t(1) << 40, SIZE_MAX })
+	{
+		NET_CHECK(RoundTrips(net::Header<Protocal>{ value % net::wire::DefaultMaxBodyBytes, value, value, Protocal::DATA }));
+		NET_CHECK(RoundTrips(net::Header<Protocal>{ 0, 1000, value, Protocal::PING }));
+	}
+	NET_CHECK(RoundTrips(net::Header<int16_t>{ 5, 1, 2, -300 }));
+	NET_CHECK(RoundTrips(net::Header<int16_t>{ 5, 1, 2, INT16_MIN }));
+	NET_CHECK(RoundTrips(net::Header<uint64_t>{ 5, 1, 2, UINT64_MAX }));
+	NET_CHECK(RoundTrips(net::Header<StructProtocal>{ 5, 1, 2, { 7, 9 } }));
+
+	// A small body and zero ids take one byte each.
+	NET_CHECK(net::wire::EncodedHeaderSize(net::Header<Protocal>{ 10, 0, 0, Protocal::PING }) == 4);
+}
+
+NET_TEST(wire_truncated_header)
+{
+	net::Header<Protocal> header{ 100000, 1000, 1001, Protocal::DATA };
+	std::array<uint8_t, net::wire::MaxHeaderSize<Protocal>> bytes{};
+	size_t written = net::wire::EncodeHeader(header, bytes.data());
+	for (size_t size = 0; size < written; ++size)
+	{
+		net::Header<Protocal> decoded;
+		size_t header_size = 0;
+		NET_CHECK(net::wire::DecodeHeader(bytes.data(), size, decoded, header_size) == net::wire::DecodeResult::Incomplete);
+	}
+
+	net::Header<StructProtocal> struct_header{ 1, 2, 3, { 4, 5 } };
+	std::array<uint8_t, net::wire::MaxHeaderSize<StructProtocal>> struct_bytes{};
+	size_t struct_written = net::wire::EncodeHeader(struct_header, struct_bytes.data());
+	net::Header<StructProtocal> decoded;
+	size_t header_size = 0;
+	NET_CHECK(net::wire::DecodeHeader(struct_bytes.data(), struct_written - 1, decoded, header_size) == net::wire::DecodeResult::Incomplete);
+}
+
+NET_TEST(wire_malformed_header)
+{
+	net::Header<Protocal> decoded;
+	size_t header_size = 0;
+
+	// A varint running past ten bytes.
+	std::array<uint8_t, 16> endless{};
+	endless.fill(0xFF);
+	NET_CHECK(net::wire::DecodeHeader(endless.data(), endless.size(), decoded, header_size) == net::wire::DecodeResult::Malformed);
+
+	// A tenth varint byte carrying more than the top bit of a 64-bit value.
+	std::array<uint8_t, 16> too_wide{};
+	too_wide.fill(0x80);
+	too_wide[9] = 0x02;
+	NET_CHECK(net::wire::DecodeHeader(too_wide.data(), too_wide.size(), decoded, header_size) == net::wire::DecodeResult::Malformed);
+
+	// A body over the limit, with the default and with a given one.
+	std::array<uint8_t, net::wire::MaxHeaderSize<Protocal>> bytes{};
+	size_t written = net::wire::EncodeHeader(net::Header<Protocal>{ net::wire::DefaultMaxBodyBytes + 1, 0, 0, Protocal::PING }, bytes.data());
+	NET_CHECK(net::wire::DecodeHeader(bytes.data(), written, decoded, header_size) == net::wire::DecodeResult::Malformed);
+	written = net::wire::EncodeHeader(net::Header<Protocal>{ 1025, 0, 0, Protocal::PING }, bytes.data());
+	NET_CHECK(net::wire::DecodeHeader(bytes.data(), written, decoded, header_size, 1024) == net::wire::DecodeResult::Malformed);
+	NET_CHECK(net::wire::DecodeHeader(bytes.data(), written, decoded, header_size, 1025) == net::wire::DecodeResult::Ok);
+
+	// A protocal value out of the range of its type.
+	written = net::wire::EncodeHeader(net::Header<uint64_t>{ 0, 0, 0, 70000 }, bytes.data());
+	net::Header<uint16_t> narrow;
+	NET_CHECK(net::wire::DecodeHeader(bytes.data(), written, narrow, header_size) == net::wire::DecodeResult::Malformed);
+}
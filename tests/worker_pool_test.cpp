@@ -0,0 +1,80 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "test.h"
+#include "server/worker_pool.h"
+
+namespace
+{
+	struct Item
+	{
+		size_t key;
+		size_t sequence;
+	};
+}
+
+// Items of many keys submitted from several threads are each handled once, those of one key in
+// the order they were submitted and never two at the same time.
+NET_TEST(worker_pool_key_order)
+{
+	constexpr size_t Keys = 64;
+	constexpr size_t Submitters = 2;
+	constexpr size_t PerKey = 2000;
+
+	std::vector<size_t> next(Keys * Submitters, 0);
+	std::vector<std::atomic<int>> running(Keys * Submitters);
+	std::atomic<size_t> handled{ 0 };
+	std::atomic<bool> ordered{ true };
+	net::WorkerPool<Item> pool(4, [&](Item& item)
+	{
+		if (running[item.key].fetch_add(1) != 0)
+			ordered = false;
+		if (item.sequence != next[item.key])
+			ordered = false;
+		next[item.key] = item.sequence + 1;
+		running[item.key].fetch_sub(1);
+		handled.fetch_add(1);
+	});
+	NET_CHECK(pool.Size() == 4);
+	pool.Run();
+
+	std::vector<std::thread> submitters;
+	for (size_t submitter = 0; submitter < Submitters; ++submitter)
+	{
+		// Each submitter owns its keys, so the order within a key is the order of one thread.
+		submitters.emplace_back([&pool, submitter]()
+		{
+			for (size_t i = 0; i < PerKey; ++i)
+			{
+				for (size_t key = submitter * Keys; key < (submitter + 1) * Keys; ++key)
+					pool.Submit(key, Item{ key, i });
+			}
+		});
+	}
+	for (std::thread& submitter : submitters)
+		submitter.join();
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+	while (handled.load() < Keys * Submitters * PerKey && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	pool.Stop();
+
+	NET_CHECK(handled.load() == Keys * Submitters * PerKey);
+	NET_CHECK(ordered.load());
+}
+
+NET_TEST(worker_pool_restart)
+{
+	std::atomic<size_t> handled{ 0 };
+	net::WorkerPool<Item> pool(2, [&handled](Item&) { handled.fetch_add(1); });
+	for (int round = 0; round < 3; ++round)
+	{
+		pool.Run();
+		pool.Submit(round, Item{ 0, 0 });
+		while (handled.load() <= static_cast<size_t>(round))
+			std::this_thread::yield();
+		pool.Stop();
+	}
+	NET_CHECK(handled.load() == 3);
+}